@@ -10,8 +10,11 @@
  * Instant recording:
  * SIGUSR1 - start new recording
  * SIGUSR2 - stop recording
+ * More recordings can go on at once, started, stopped and scheduled by the
+ * control socket (-C).
  *
- * A cache directory is needed.
+ * A cache directory is needed, unless only a RAM buffer (-w) or a circular
+ * cache file (-c) is used.
  *
  * Example usage:
  * mplayer -dumpstream -dumpfile /dev/fd/3 dvb://channel 3>&1 |
@@ -23,264 +26,4239 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
 #define MAX(a,b) (((a) > (b)) ? (a) : (b))
 
-char *cachedir = 0, *recorddir = 0;
+/**
+ * Size of one I/O block and how many blocks a handler moves per wakeup.
+ */
+#define IO_SIZE (64 * 1024)
+#define IO_BUDGET 16
+
+/**
+ * Consumed parts of mapped chunks are given back in steps of this size.
+ */
+#define RELEASE_SIZE (1024 * 1024)
+
+/**
+ * The RAM tier is rounded up to this when on hugepages.
+ */
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/**
+ * MPEG transport stream packet size and sync byte. Overflows cut the stream
+ * on packet boundaries.
+ */
+#define TS_PACKET 188
+#define TS_SYNC 0x47
+
+/**
+ * How often to retry writing to the cache after it filled up, in ms.
+ */
+#define RETRY_INTERVAL 100
+
+/**
+ * Recordings are copied from the cache files in batches of at least this
+ * much, so that pending cache writes are waited for only that often.
+ */
+#define RECORD_BATCH (1024 * 1024)
+
+/**
+ * Ranges aligned to this are cloned (reflinked) from the cache files to
+ * recordings and exports, where the filesystem can.
+ */
+#define CLONE_BLOCK 4096
+
+char *cachedir = 0, *recorddir = 0, *cachefile = 0;
+long long cachesize = 0;
+int cachetime = 0;
+
+/**
+ * Recordings started without a position start this many seconds back.
+ */
+int recordback = 0;
+
+/**
+ * Recordings go on in a new file every rotatesize bytes or rotatetime
+ * seconds of stream time, if set.
+ */
+long long rotatesize = 0;
+int rotatetime = 0;
+
+/**
+ * What to do when the cache disk is full: evict the oldest chunks, stop
+ * reading the input, or keep the data in memory until there's room.
+ */
+enum { OVERFLOW_DROP, OVERFLOW_BLOCK, OVERFLOW_SPILL } overflow = OVERFLOW_DROP;
+
+/**
+ * Overflow counters, in bytes. Evicted is unread data taken from the cache,
+ * dropped is input that never made it there, spilled is input kept in
+ * memory because the disk was full, and blocked the same with the block
+ * policy, which stops reading the input once the memory is full too.
+ */
+long long evicted = 0, dropped = 0, spilled = 0, blocked = 0;
+
+/**
+ * The disk was found full and we're waiting for the retry. Resync is set
+ * when input was dropped and the next packet boundary is to be found.
+ */
+int disk_full = 0, resync = 0;
 int chunksize = 16 * 1024 * 1024;
+int use_mmap = 0, use_hugepages = 0;
+
+/**
+ * Input and output file descriptors. More outputs can be given with -O.
+ */
+#define MAX_OUTPUTS 16
+
+int infd = 0, outfd = 1;
+int outfds[MAX_OUTPUTS], noutfds = 0;
+
+/**
+ * Structure for storage. Its data is at offr to offw, what's before offr
+ * was cut off. Base is the stream position of its start.
+ */
+struct storage_t {
+    struct storage_t *next;
+
+    char name[32];
+    int fd;
+    int offr, offw;
+    long long base;
+    int slot;
+
+    char *map;
+    int offd;
+
+    /* How far the writer thread has written it out, and how far writes
+     * to it were queued. */
+    int offs, offq;
+
+    /* Its space is reserved. Its pages were spliced to an output, a pipe
+     * may still hold them. */
+    int reserved, spliced;
+
+    time_t stamp;
+};
+
+struct storage_t *storage = 0, *last_storage = 0;
+int nstorage = 0;
+
+/**
+ * Outputs. Each reads the stream at its own position, and storage is
+ * dropped only when all of them are past it or it's out of the retention
+ * (-S, -T). The first one is the main output, the one the control socket
+ * acts on. Recordings are readers too, after the outputs. The loop runs
+ * while there are outputs, or with -l, while the main output waits for a
+ * new consumer, detached, with fd -1.
+ */
+struct reader_t {
+    struct reader_t *next;
+
+    int fd;
+    long long pos;
+    int splice_out;
+    struct watch_t *w;
+
+    /* Caught up, takes the input as it comes. */
+    int live;
+
+    /* Paused, or going to jump to seek once it gets to until. */
+    int paused;
+    long long seek, until;
+
+    /* A recording: a file fed from the stream as it comes in, until end
+     * if that's not -1. Recordings, unlike exports, have an id and a name,
+     * and rotate to the next part of the name from start on. */
+    int record;
+    long long end;
+    int id, part;
+    char *name;
+    long long start;
+};
+
+struct reader_t *readers = 0;
+int noutputs = 0;
+
+/**
+ * The main output, or 0 once it's gone without -l.
+ */
+struct reader_t *main_output = 0;
+
+/**
+ * Circular buffer. Either the write-behind RAM tier in front of the storage
+ * or, with -c, a preallocated cache file or block device used as a
+ * circular log. The newest data is kept here and only what the outputs lag
+ * behind by more than the size of the ring is written to the storage.
+ * Without a cache dir it is the only storage and the oldest data is lost
+ * when it fills up.
+ *
+ * Head and tail are stream positions, even without a ring: the storage
+ * ends at the tail and the stream at the head.
+ */
+struct ring_t {
+    char *buf;
+    long long size;
+    long long head, tail, offd;
+};
+
+struct ring_t ring = { 0, 0, 0, 0, 0 };
+
+/**
+ * Whether the ring is the write-behind tier (-w). Otherwise, with a cache
+ * dir, it only holds what didn't fit on a full disk.
+ */
+int write_behind = 0;
+
+/**
+ * The recording started by SIGUSR1, if any. It's one of the readers, as
+ * are all the others, told apart by their ids.
+ */
+struct reader_t *recording = 0;
+int lastid = 0;
+
+/**
+ * Set by SIGINT and SIGTERM. Signals come through a signalfd in the event
+ * loop, there are no handlers.
+ */
+int quit = 0;
+
+/**
+ * io_uring backend for the chunk I/O. Writes are copied to registered
+ * buffers and queued, the whole batch is submitted once per wakeup or
+ * together with the next read. A read waits only for the writes to the
+ * range it reads, and the loop is woken up through an eventfd as writes
+ * finish.
+ */
+#define URING_ENTRIES 64
+#define URING_BUFFERS 32
+#define URING_FILES 256
+#define URING_READ ((uint64_t) -1)
+
+struct uring_t {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned queued, inflight;
+    int fixed_bufs, fixed_files;
+    int read_res, read_done;
+    int efd;
+} uring = { .fd = -1, .efd = -1 };
+
+/**
+ * A write buffer and the write it is used for.
+ */
+struct uring_buf_t {
+    char *data;
+    struct iovec iov;
+    int busy;
+    struct storage_t *s;
+    off_t off;
+};
+
+struct uring_buf_t uring_bufs[URING_BUFFERS];
+int uring_files[URING_FILES];
+
+/**
+ * Set up the ring, buffers and file table.
+ * \return 0 on success, -1 if io_uring isn't available.
+ */
+int uring_init(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd == -1)
+        return -1;
+
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd == -1)
+        perror("eventfd"), abort();
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD,
+                &efd, 1) != 0) {
+        close(efd);
+        close(fd);
+        return -1;
+    }
+
+    char *sq = mmap(0, p.sq_off.array + p.sq_entries * sizeof(unsigned),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_SQ_RING);
+    char *cq = mmap(0, p.cq_off.cqes +
+            p.cq_entries * sizeof(struct io_uring_cqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_CQ_RING);
+    void *sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        close(efd);
+        close(fd);
+        return -1;
+    }
+
+    uring.fd = fd;
+    uring.efd = efd;
+    uring.sq_head = (unsigned *) (sq + p.sq_off.head);
+    uring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *) (sq + p.sq_off.array);
+    uring.cq_head = (unsigned *) (cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    uring.sqes = sqes;
+
+    struct iovec iovs[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        uring_bufs[i].data = mmap(0, IO_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (uring_bufs[i].data == MAP_FAILED)
+            perror("mmap"), abort();
+        iovs[i].iov_base = uring_bufs[i].data;
+        iovs[i].iov_len = IO_SIZE;
+    }
+
+    /* Both registrations are optional, we only lose some speed. */
+    uring.fixed_bufs = syscall(__NR_io_uring_register, fd,
+            IORING_REGISTER_BUFFERS, iovs, URING_BUFFERS) == 0;
+
+    for (int i = 0; i < URING_FILES; i++)
+        uring_files[i] = -1;
+    uring.fixed_files = syscall(__NR_io_uring_register, fd,
+            IORING_REGISTER_FILES, uring_files, URING_FILES) == 0;
+
+    return 0;
+}
+
+/**
+ * Put fd into the fixed file table.
+ * \return The slot or -1 if there is none.
+ */
+int uring_add_file(int fd)
+{
+    if (!uring.fixed_files)
+        return -1;
+
+    for (int i = 0; i < URING_FILES; i++) {
+        if (uring_files[i] != -1)
+            continue;
+
+        struct io_uring_files_update up;
+        memset(&up, 0, sizeof(up));
+        up.offset = i;
+        up.fds = (uintptr_t) &fd;
+        if (syscall(__NR_io_uring_register, uring.fd,
+                    IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+            return -1;
+
+        uring_files[i] = fd;
+        return i;
+    }
+
+    return -1;
+}
+
+/**
+ * Remove a slot from the fixed file table.
+ */
+void uring_del_file(int slot)
+{
+    if (slot == -1)
+        return;
+
+    int fd = -1;
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (uintptr_t) &fd;
+    if (syscall(__NR_io_uring_register, uring.fd,
+                IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+        perror("io_uring_register"), abort();
+
+    uring_files[slot] = -1;
+}
+
+/**
+ * The disk is full and the data written at off is gone. Keep the chunk
+ * readable by leaving a hole there. Only storages with their space reserved
+ * are written asynchronously, so it shouldn't come to that.
+ */
+void lost_write(int fd, off_t off, int len)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        perror("fstat"), abort();
+    if (st.st_size < off + len && ftruncate(fd, off + len))
+        perror("ftruncate"), abort();
+}
+
+/**
+ * Handle a finished write.
+ */
+void uring_write_done(struct uring_buf_t *b, int res)
+{
+    int len = b->iov.iov_len;
+
+    /* Finish short writes synchronously. */
+    if (res >= 0 && res < len) {
+        int sz = pwrite(b->s->fd, b->data + res, len - res, b->off + res);
+        res = (sz == -1) ? -errno : res + sz;
+    }
+
+    if (res < 0) {
+        if (res != -ENOSPC)
+            errno = -res, perror("write"), abort();
+        dropped += len;
+        lost_write(b->s->fd, b->off, len);
+    }
+
+    b->busy = 0;
+}
+
+/**
+ * Process the completion queue.
+ */
+void uring_reap(void)
+{
+    unsigned head = *uring.cq_head;
+
+    while (head != __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+
+        if (cqe->user_data == URING_READ) {
+            uring.read_res = cqe->res;
+            uring.read_done = 1;
+        } else {
+            uring_write_done(&uring_bufs[cqe->user_data], cqe->res);
+        }
+
+        uring.inflight--;
+        head++;
+    }
+
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submit the queued entries and wait for at least wait completions.
+ */
+void uring_submit(unsigned wait)
+{
+    int ret = syscall(__NR_io_uring_enter, uring.fd, uring.queued, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+    if (ret == -1 && errno != EINTR)
+        perror("io_uring_enter"), abort();
+
+    if (ret > 0) {
+        uring.inflight += ret;
+        uring.queued -= ret;
+    }
+
+    uring_reap();
+}
+
+/**
+ * Get a free submission entry.
+ */
+struct io_uring_sqe *uring_sqe(void)
+{
+    while (*uring.sq_tail - __atomic_load_n(uring.sq_head, __ATOMIC_ACQUIRE)
+            >= URING_ENTRIES)
+        uring_submit(0);
+
+    unsigned tail = *uring.sq_tail;
+    unsigned idx = tail & *uring.sq_mask;
+    struct io_uring_sqe *sqe = &uring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    uring.sq_array[idx] = idx;
+
+    return sqe;
+}
+
+/**
+ * Make the entry returned by uring_sqe visible to the kernel.
+ */
+void uring_push(void)
+{
+    __atomic_store_n(uring.sq_tail, *uring.sq_tail + 1, __ATOMIC_RELEASE);
+    uring.queued++;
+}
+
+/**
+ * Set the target file of an entry, using the fixed file if there is one.
+ */
+void uring_set_file(struct io_uring_sqe *sqe, int fd, int slot)
+{
+    if (slot != -1) {
+        sqe->fd = slot;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+        sqe->fd = fd;
+    }
+}
+
+/**
+ * Queue a write of buf to a storage at offset off.
+ */
+void uring_write(struct storage_t *s, off_t off, const char *buf, int bufsz)
+{
+    while (bufsz > 0) {
+        struct uring_buf_t *b = 0;
+        while (!b) {
+            for (int i = 0; i < URING_BUFFERS && !b; i++)
+                if (!uring_bufs[i].busy)
+                    b = &uring_bufs[i];
+            if (!b)
+                uring_submit(1);
+        }
+
+        int sz = MIN(bufsz, IO_SIZE);
+        memcpy(b->data, buf, sz);
+        b->iov.iov_base = b->data;
+        b->iov.iov_len = sz;
+        b->busy = 1;
+        b->s = s;
+        b->off = off;
+
+        struct io_uring_sqe *sqe = uring_sqe();
+        if (uring.fixed_bufs) {
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->addr = (uintptr_t) b->data;
+            sqe->len = sz;
+            sqe->buf_index = b - uring_bufs;
+        } else {
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->addr = (uintptr_t) &b->iov;
+            sqe->len = 1;
+        }
+        uring_set_file(sqe, s->fd, s->slot);
+        sqe->off = off;
+        sqe->user_data = b - uring_bufs;
+        uring_push();
+
+        buf += sz;
+        bufsz -= sz;
+        off += sz;
+    }
+
+    s->offq = off;
+}
+
+/**
+ * Find the first write to a storage that isn't finished.
+ * \return Its offset, or -1 if there is none.
+ */
+int uring_pending(struct storage_t *s)
+{
+    int off = -1;
+
+    uring_reap();
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        struct uring_buf_t *b = &uring_bufs[i];
+        if (b->busy && b->s == s && (off == -1 || b->off < off))
+            off = b->off;
+    }
+
+    return off;
+}
+
+/**
+ * Read from fd at offset off. The writes to that range must be done.
+ * \return The amount of data read.
+ */
+int uring_read(int fd, int slot, off_t off, char *buf, int bufsz)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = bufsz };
+
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_READV;
+    uring_set_file(sqe, fd, slot);
+    sqe->addr = (uintptr_t) &iov;
+    sqe->len = 1;
+    sqe->off = off;
+    sqe->user_data = URING_READ;
+    uring_push();
+
+    uring.read_done = 0;
+    uring_submit(1);
+    while (!uring.read_done)
+        uring_submit(1);
+
+    if (uring.read_res < 0)
+        errno = -uring.read_res, perror("read"), abort();
+
+    return uring.read_res;
+}
+
+/**
+ * Submit whatever is queued without waiting.
+ */
+void uring_flush(void)
+{
+    if (uring.fd != -1 && uring.queued)
+        uring_submit(0);
+}
+
+/**
+ * Wait until all submitted I/O is finished.
+ */
+void uring_drain(void)
+{
+    if (uring.fd == -1)
+        return;
+
+    uring_flush();
+    while (uring.inflight || uring.queued)
+        uring_submit(1);
+}
+
+/**
+ * Worker threads (-t). The blocking writes to the cache and to the
+ * recording are done by a thread each, so that a slow disk stalls neither
+ * the input nor the output. Each is fed by a single-producer
+ * single-consumer queue of buffers: the main thread fills the job at the
+ * tail, the worker does the one at the head and gives the slot back.
+ */
+#define QUEUE_SIZE 64
+#define MAX_RECORDINGS 16
+
+struct job_t {
+    char *data;
+    int len;
+
+    /* Cache write: storage, its file and offset. */
+    struct storage_t *s;
+    int fd;
+    off_t off;
+
+    /* Recording: the files, the block goes to each of them. */
+    int nfds;
+    int fds[MAX_RECORDINGS];
+};
+
+struct queue_t {
+    struct job_t jobs[QUEUE_SIZE];
+    unsigned head, tail;
+    sem_t items, slots;
+    pthread_t thread;
+    void (*run)(struct queue_t *q, struct job_t *j);
+
+    /* Eventfd poked whenever a job is done, or -1. */
+    int wake;
+
+    /* For the main thread to wait for a job in particular. */
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int waiting;
+
+    /* Written by the worker only. */
+    long long lost;
+    int failed;
+};
+
+struct queue_t writer, recorder;
+int use_threads = 0;
+
+/**
+ * Wait on a semaphore, ignoring signals.
+ */
+void sem_wait_nointr(sem_t *sem)
+{
+    while (sem_wait(sem) == -1)
+        if (errno != EINTR)
+            perror("sem_wait"), abort();
+}
+
+/**
+ * Worker thread main loop. A job without data stops it.
+ */
+void *queue_thread(void *arg)
+{
+    struct queue_t *q = arg;
+
+    while (1) {
+        sem_wait_nointr(&q->items);
+
+        struct job_t *j = &q->jobs[q->head % QUEUE_SIZE];
+        if (!j->data)
+            return 0;
+
+        q->run(q, j);
+        q->head++;
+        sem_post(&q->slots);
+
+        uint64_t one = 1;
+        if (q->wake != -1 && write(q->wake, &one, sizeof(one)) == -1 &&
+                errno != EAGAIN)
+            perror("write"), abort();
+
+        if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&q->lock);
+            pthread_cond_broadcast(&q->done);
+            pthread_mutex_unlock(&q->lock);
+        }
+    }
+}
+
+/**
+ * Set up a queue and start its worker.
+ */
+void queue_init(struct queue_t *q,
+        void (*run)(struct queue_t *q, struct job_t *j), int wake)
+{
+    memset(q, 0, sizeof(*q));
+    q->run = run;
+    q->wake = wake;
+
+    for (int i = 0; i < QUEUE_SIZE; i++)
+        if (!(q->jobs[i].data = malloc(IO_SIZE)))
+            perror("malloc"), abort();
+
+    if (sem_init(&q->items, 0, 0) == -1 ||
+            sem_init(&q->slots, 0, QUEUE_SIZE) == -1)
+        perror("sem_init"), abort();
+    pthread_mutex_init(&q->lock, 0);
+    pthread_cond_init(&q->done, 0);
+
+    errno = pthread_create(&q->thread, 0, queue_thread, q);
+    if (errno)
+        perror("pthread_create"), abort();
+}
+
+/**
+ * Get the job at the tail of the queue. Follow with queue_push.
+ * \return The job, or 0 if the queue is full and wait isn't set.
+ */
+struct job_t *queue_get(struct queue_t *q, int wait)
+{
+    if (wait)
+        sem_wait_nointr(&q->slots);
+    else if (sem_trywait(&q->slots) == -1)
+        return 0;
+
+    return &q->jobs[q->tail % QUEUE_SIZE];
+}
+
+/**
+ * Hand the job returned by queue_get over to the worker.
+ */
+void queue_push(struct queue_t *q)
+{
+    q->tail++;
+    sem_post(&q->items);
+}
+
+/**
+ * Whether a job can be queued without waiting.
+ */
+int queue_room(struct queue_t *q)
+{
+    int n;
+    if (sem_getvalue(&q->slots, &n) == -1)
+        perror("sem_getvalue"), abort();
+    return n > 0;
+}
+
+/**
+ * Wait until the worker has done all the queued jobs.
+ */
+void queue_drain(struct queue_t *q)
+{
+    for (int i = 0; i < QUEUE_SIZE; i++)
+        sem_wait_nointr(&q->slots);
+    for (int i = 0; i < QUEUE_SIZE; i++)
+        sem_post(&q->slots);
+}
+
+/**
+ * Finish the queued jobs and stop the worker.
+ */
+void queue_stop(struct queue_t *q)
+{
+    struct job_t *j = queue_get(q, 1);
+    char *data = j->data;
+    j->data = 0;
+    queue_push(q);
+
+    errno = pthread_join(q->thread, 0);
+    if (errno)
+        perror("pthread_join"), abort();
+
+    /* Give the buffer back for the cleanup below. */
+    j->data = data;
+    for (int i = 0; i < QUEUE_SIZE; i++)
+        free(q->jobs[i].data);
+    sem_destroy(&q->items);
+    sem_destroy(&q->slots);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->done);
+}
+
+/**
+ * Writer thread job: write a block to a storage.
+ */
+void write_job(struct queue_t *q, struct job_t *j)
+{
+    int done = 0;
+
+    while (done < j->len) {
+        int sz = pwrite(j->fd, j->data + done, j->len - done, j->off + done);
+        if (sz == -1 && errno == EINTR)
+            continue;
+        if (sz == -1) {
+            if (errno != ENOSPC)
+                perror("write"), abort();
+            __atomic_add_fetch(&q->lost, j->len - done, __ATOMIC_RELAXED);
+            lost_write(j->fd, j->off + done, j->len - done);
+            break;
+        }
+        done += sz;
+    }
+
+    __atomic_store_n(&j->s->offs, j->off + j->len, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Whether fd is one of the n in fds.
+ */
+int has_fd(const int *fds, int n, int fd)
+{
+    for (int i = 0; i < n; i++)
+        if (fds[i] == fd)
+            return 1;
+    return 0;
+}
+
+/**
+ * Recorder thread job: write a block to recordings, or close the one given
+ * if there's nothing to write. After an error, the rest of that recording
+ * is skipped.
+ */
+void record_job(struct queue_t *q, struct job_t *j)
+{
+    static int bad[MAX_RECORDINGS], nbad = 0;
+
+    if (!j->len) {
+        close(j->fds[0]);
+        for (int i = 0; i < nbad; i++)
+            if (bad[i] == j->fds[0])
+                bad[i--] = bad[--nbad];
+        return;
+    }
+
+    for (int i = 0; i < j->nfds; i++) {
+        int fd = j->fds[i];
+
+        for (int done = 0; !has_fd(bad, nbad, fd) && done < j->len; ) {
+            int sz = write(fd, j->data + done, j->len - done);
+            if (sz == -1 && errno == EINTR)
+                continue;
+            if (sz <= 0) {
+                fprintf(stderr, "Recording error\n");
+                if (nbad < MAX_RECORDINGS)
+                    bad[nbad++] = fd;
+                __atomic_store_n(&q->failed, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            done += sz;
+        }
+    }
+}
+
+/**
+ * Queue a write of buf to a storage at offset off.
+ */
+void thread_write(struct storage_t *s, off_t off, const char *buf, int bufsz)
+{
+    while (bufsz > 0) {
+        struct job_t *j = queue_get(&writer, 1);
+        int sz = MIN(bufsz, IO_SIZE);
+        memcpy(j->data, buf, sz);
+        j->len = sz;
+        j->s = s;
+        j->fd = s->fd;
+        j->off = off;
+        queue_push(&writer);
+
+        buf += sz;
+        bufsz -= sz;
+        off += sz;
+    }
+
+    s->offq = off;
+}
+
+/**
+ * Wait until the writer thread has done the writes queued to a storage
+ * below off, and only those.
+ */
+void thread_sync(struct storage_t *s, int off)
+{
+    off = MIN(off, s->offq);
+    if (!use_threads || __atomic_load_n(&s->offs, __ATOMIC_SEQ_CST) >= off)
+        return;
+
+    pthread_mutex_lock(&writer.lock);
+    __atomic_store_n(&writer.waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&s->offs, __ATOMIC_SEQ_CST) < off)
+        pthread_cond_wait(&writer.done, &writer.lock);
+    __atomic_store_n(&writer.waiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&writer.lock);
+}
+
+/**
+ * How far the data of a storage is in its file. The rest is still queued.
+ */
+int storage_synced(struct storage_t *s)
+{
+    int off = s->offw;
+
+    if (uring.fd != -1) {
+        int pending = uring_pending(s);
+        if (pending != -1)
+            off = MIN(off, pending);
+    }
+
+    if (use_threads) {
+        int offs = __atomic_load_n(&s->offs, __ATOMIC_ACQUIRE);
+        if (offs < s->offq)
+            off = MIN(off, offs);
+    }
+
+    return off;
+}
+
+/**
+ * Wait until the writes queued to a storage below off are done.
+ */
+void sync_storage(struct storage_t *s, int off)
+{
+    int pending;
+    while (uring.fd != -1 && (pending = uring_pending(s)) != -1 &&
+            pending < off)
+        uring_submit(1);
+
+    thread_sync(s, off);
+}
+
+/**
+ * Wait until all the queued cache writes are done, by io_uring or the
+ * writer thread.
+ */
+void drain_storage(void)
+{
+    uring_drain();
+    if (use_threads)
+        queue_drain(&writer);
+}
+
+/**
+ * Monotonic time in seconds.
+ */
+time_t monotime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Map a fresh storage into memory. The file must be fallocated, so that
+ * a full disk is found out by that and not by a SIGBUS later. If anything
+ * fails the storage stays unmapped and uses plain I/O.
+ */
+void map_storage(struct storage_t *s)
+{
+    char *map = mmap(0, chunksize, PROT_READ | PROT_WRITE, MAP_SHARED,
+            s->fd, 0);
+    if (map == MAP_FAILED)
+        return;
+
+    madvise(map, chunksize, MADV_SEQUENTIAL);
+    s->map = map;
+}
+
+/**
+ * Give the pages of a mapped storage up to off back to the kernel. The data
+ * stays in the file.
+ */
+void release_storage(struct storage_t *s, int off)
+{
+    if (!s->map)
+        return;
+
+    off &= ~(getpagesize() - 1);
+    if (off - s->offd < RELEASE_SIZE && off != chunksize)
+        return;
+
+    if (off > s->offd && madvise(s->map + s->offd, off - s->offd,
+                MADV_DONTNEED) == -1)
+        perror("madvise"), abort();
+    s->offd = off;
+}
+
+/**
+ * Read data from one storage at the given offset.
+ * \return The amount of data read.
+ */
+int read_chunk(struct storage_t *s, int off, char *buf, int bufsz)
+{
+    int tord = MIN(s->offw - off, bufsz);
+    if (s->map) {
+        memcpy(buf, s->map + off, tord);
+        return tord;
+    }
+
+    sync_storage(s, off + tord);
+    if (uring.fd != -1)
+        return uring_read(s->fd, s->slot, off, buf, tord);
+
+    int sz = pread(s->fd, buf, tord, off);
+    if (sz == -1)
+        perror("pread"), abort();
+    if (sz == 0)
+        fprintf(stderr, "End of file in read_chunk, shouldn't happen.\n"),
+	    abort();
+
+    return sz;
+}
+
+/**
+ * Find the first TS packet boundary in buf: a sync byte, with another one a
+ * packet further if buf is long enough.
+ * \return Its offset, or -1 if there is none.
+ */
+int ts_boundary(const char *buf, int sz)
+{
+    for (int i = 0; i < MIN(sz, TS_PACKET); i++)
+        if (buf[i] == TS_SYNC &&
+                (i + TS_PACKET >= sz || buf[i + TS_PACKET] == TS_SYNC))
+            return i;
+
+    return -1;
+}
+
+/**
+ * Find the first TS packet boundary in a storage at or after off.
+ * \return Its offset, or -1 if there is none.
+ */
+int storage_boundary(struct storage_t *s, int off)
+{
+    char buf[2 * TS_PACKET];
+
+    int sz = MIN(s->offw - off, (int) sizeof(buf));
+    if (sz <= 0)
+        return -1;
+
+    int b = ts_boundary(buf, read_chunk(s, off, buf, sz));
+    return (b == -1) ? -1 : off + b;
+}
+
+/**
+ * Find the start of the last partial TS packet in a storage, but not before
+ * off.
+ * \return Its offset, or the end of data if the last packet is whole or
+ * there are no packets.
+ */
+int storage_last_boundary(struct storage_t *s, int off)
+{
+    int b = storage_boundary(s, MAX(off, s->offw - 2 * TS_PACKET));
+    if (b == -1)
+        return s->offw;
+
+    return b + (s->offw - b) / TS_PACKET * TS_PACKET;
+}
+
+/**
+ * Create a new storage file. Its space is reserved up front, so that it is
+ * contiguous on disk and a full disk shows up here.
+ * \return The storage, or 0 if the disk is full.
+ */
+struct storage_t *create_storage(void)
+{
+    struct storage_t *s = malloc(sizeof(struct storage_t));
+    if (!s)
+        perror("malloc"), abort();
+
+    s->next = 0;
+    strcpy(s->name, "timeshiftXXXXXX");
+    s->fd = mkstemp(s->name);
+    if (s->fd == -1 && (errno == ENOSPC || errno == EDQUOT)) {
+        free(s);
+        return 0;
+    }
+    if (s->fd == -1)
+        perror("mkstemp"), abort();
+
+    int reserved = fallocate(s->fd, 0, 0, chunksize) == 0;
+    if (!reserved && (errno == ENOSPC || errno == EDQUOT)) {
+        close(s->fd);
+        unlink(s->name);
+        free(s);
+        return 0;
+    }
+
+    s->offr = s->offw = 0;
+    s->offs = s->offq = 0;
+    s->reserved = reserved;
+    s->spliced = 0;
+    s->slot = (uring.fd != -1) ? uring_add_file(s->fd) : -1;
+
+    s->map = 0;
+    s->offd = 0;
+    if (reserved && use_mmap)
+        map_storage(s);
+
+    return s;
+}
+
+/**
+ * Close and remove a storage file.
+ */
+void destroy_storage(struct storage_t *s)
+{
+    uring_del_file(s->slot);
+    if (s->map)
+        munmap(s->map, chunksize);
+    close(s->fd);
+    unlink(s->name);
+    free(s);
+}
+
+/**
+ * Pool of spare storages. Their files are reused in place instead of being
+ * created and unlinked for every chunk.
+ */
+#define POOL_SIZE 4
+
+struct storage_t *pool = 0;
+int pooled = 0;
+
+/**
+ * Detach a spliced storage from the pages the outputs' pipes may still hold,
+ * so that new data doesn't go into them: truncate the file and reserve its
+ * space again.
+ * \return 0 on success, -1 if the space can't be reserved anymore.
+ */
+int recycle_storage(struct storage_t *s)
+{
+    if (s->map) {
+        munmap(s->map, chunksize);
+        s->map = 0;
+    }
+    if (ftruncate(s->fd, 0) == -1)
+        perror("ftruncate"), abort();
+    s->spliced = 0;
+
+    if (s->reserved && fallocate(s->fd, 0, 0, chunksize) == -1)
+        return -1;
+    if (s->reserved && use_mmap)
+        map_storage(s);
+    return 0;
+}
+
+/**
+ * Put a storage to the pool, or destroy it if the pool is full.
+ */
+void pool_storage(struct storage_t *s)
+{
+    if (pooled == POOL_SIZE || (s->spliced && recycle_storage(s) == -1)) {
+        destroy_storage(s);
+        return;
+    }
+
+    s->offr = s->offw = 0;
+    s->offd = 0;
+    s->offs = s->offq = 0;
+    s->next = pool;
+    pool = s;
+    pooled++;
+}
+
+/**
+ * Destroy all the pooled storages.
+ */
+void drop_pool(void)
+{
+    while (pool) {
+        struct storage_t *s = pool;
+        pool = s->next;
+        destroy_storage(s);
+    }
+    pooled = 0;
+}
+
+/**
+ * Stream positions of the start and the end of the data in a storage.
+ */
+long long storage_start(struct storage_t *s)
+{
+    return s->base + s->offr;
+}
+
+long long storage_end(struct storage_t *s)
+{
+    return s->base + s->offw;
+}
+
+/**
+ * Index of the storage list by stream position. It's a ring of the storages
+ * in list order, so appending and dropping the first are O(1), and as their
+ * positions only grow, finding one is a binary search.
+ */
+struct {
+    struct storage_t **s;
+    int size;
+    int first, count;
+} chunks = { 0, 0, 0, 0 };
+
+/**
+ * The i-th storage in the index.
+ */
+struct storage_t *chunk_at(int i)
+{
+    return chunks.s[(chunks.first + i) & (chunks.size - 1)];
+}
+
+/**
+ * Add a storage at the end of the index, growing it if it's full.
+ */
+void index_append(struct storage_t *s)
+{
+    if (chunks.count == chunks.size) {
+        int size = chunks.size ? chunks.size * 2 : 64;
+        struct storage_t **a = malloc(size * sizeof(struct storage_t *));
+        if (!a)
+            perror("malloc"), abort();
+
+        for (int i = 0; i < chunks.count; i++)
+            a[i] = chunk_at(i);
+        free(chunks.s);
+        chunks.s = a;
+        chunks.size = size;
+        chunks.first = 0;
+    }
+
+    chunks.count++;
+    chunks.s[(chunks.first + chunks.count - 1) & (chunks.size - 1)] = s;
+}
+
+/**
+ * Drop the first storage from the index.
+ */
+void index_drop_first(void)
+{
+    chunks.first = (chunks.first + 1) & (chunks.size - 1);
+    chunks.count--;
+}
+
+/**
+ * Find the index of the first storage ending after pos.
+ * \return The index, or the count if pos is past all of them.
+ */
+int index_find(long long pos)
+{
+    int lo = 0, hi = chunks.count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (storage_end(chunk_at(mid)) <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+/**
+ * Find the index of a storage. Only empty ones share a base, so it's a
+ * binary search and at most a few steps.
+ */
+int index_of(struct storage_t *s)
+{
+    int lo = 0, hi = chunks.count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (chunk_at(mid)->base < s->base)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    while (chunk_at(lo) != s)
+        lo++;
+    return lo;
+}
+
+/**
+ * Remove a storage from the middle of the index. The ones after it move
+ * down, which is fine as it only happens on eviction.
+ */
+void index_remove(struct storage_t *s)
+{
+    for (int i = index_of(s); i < chunks.count - 1; i++)
+        chunks.s[(chunks.first + i) & (chunks.size - 1)] = chunk_at(i + 1);
+    chunks.count--;
+}
+
+/**
+ * Find the storage holding the stream position pos, or the first one after
+ * it if pos was cut off.
+ * \return The storage, or 0 if pos is past all of them.
+ */
+struct storage_t *find_storage(long long pos)
+{
+    int i = index_find(pos);
+    return (i < chunks.count) ? chunk_at(i) : 0;
+}
+
+/**
+ * Position of the slowest reader, or the end of the stream if there are no
+ * readers.
+ */
+long long min_reader_pos(void)
+{
+    long long pos = ring.head;
+    for (struct reader_t *r = readers; r; r = r->next)
+        pos = MIN(pos, r->pos);
+    return pos;
+}
+
+/**
+ * Position of the oldest data there is.
+ */
+long long oldest_pos(void)
+{
+    return storage ? storage_start(storage) : ring.tail;
+}
+
+/**
+ * Position of the first data there is at or after pos, moving over what was
+ * cut off.
+ */
+long long data_pos(long long pos)
+{
+    struct storage_t *s = find_storage(pos);
+    return MAX(pos, s ? storage_start(s) : ring.tail);
+}
+
+/**
+ * Position of the furthest reader in the stream part from to to, or -1 if
+ * none is there.
+ */
+long long reader_between(long long from, long long to)
+{
+    long long pos = -1;
+    for (struct reader_t *r = readers; r; r = r->next)
+        if (r->pos >= from && r->pos < to)
+            pos = MAX(pos, r->pos);
+    return pos;
+}
+
+/**
+ * Position of the furthest reader in a storage, counting those in what was
+ * cut off before it, or -1 if none is there.
+ */
+long long reader_in(struct storage_t *s)
+{
+    if (!s)
+        return -1;
+
+    int i = index_of(s);
+    long long from = i ? storage_end(chunk_at(i - 1)) : 0;
+
+    return reader_between(from, storage_end(s));
+}
+
+/**
+ * The amount of data in the stream part from to to that the slowest reader
+ * hasn't read yet.
+ */
+long long unread(long long from, long long to)
+{
+    return MAX(0, to - MAX(from, min_reader_pos()));
+}
+
+/**
+ * Move the start of a storage to a packet boundary, unless some reader is
+ * already past it.
+ */
+void resync_storage(struct storage_t *s)
+{
+    if (!s)
+        return;
+
+    int b = storage_boundary(s, s->offr);
+    if (b > s->offr && reader_between(storage_start(s) + 1,
+                s->base + b) == -1) {
+        evicted += unread(storage_start(s), s->base + b);
+        s->offr = b;
+    }
+}
+
+/**
+ * Alloc a new storage and push it to the list.
+ * \return 0 on success, -1 if the disk is full.
+ */
+int alloc_storage(void)
+{
+    struct storage_t *s = pool;
+
+    if (s) {
+        pool = s->next;
+        pooled--;
+        s->next = 0;
+    } else if (!(s = create_storage())) {
+        return -1;
+    }
+
+    time_t now = monotime();
+    s->stamp = now;
+    if (last_storage)
+        last_storage->stamp = now;
+    s->base = ring.tail;
+
+    if (last_storage)
+        last_storage->next = s;
+    else
+        storage = s;
+    last_storage = s;
+    index_append(s);
+    nstorage++;
+
+    return 0;
+}
+
+/**
+ * Drop the first storage from the list.
+ */
+void drop_storage(void)
+{
+    if (!storage)
+        fprintf(stderr, "No storage to drop!\n"), abort();
+
+    struct storage_t *s = storage;
+
+    /* Writes to it may still be queued if it was handed off directly. */
+    sync_storage(s, s->offq);
+
+    storage = storage->next;
+    if (s == last_storage)
+        last_storage = 0;
+    index_drop_first();
+    nstorage--;
+    pool_storage(s);
+}
+
+/**
+ * Clean up the storage.
+ */
+void drop_all_storage(void)
+{
+    drain_storage();
+    while (storage)
+        drop_storage();
+    drop_pool();
+
+    free(chunks.s);
+    chunks.s = 0;
+    chunks.size = 0;
+}
+
+/**
+ * Whether the first storage is out of the retention. Without any, storage
+ * is dropped as soon as all the readers are past it.
+ */
+int expired_storage(void)
+{
+    if (!cachesize && !cachetime)
+        return storage_end(storage) <= min_reader_pos();
+
+    if (cachesize && (long long) nstorage * chunksize > cachesize)
+        return 1;
+    if (cachetime && monotime() - storage->stamp > cachetime)
+        return 1;
+
+    return 0;
+}
+
+/**
+ * Drop read storage and what's out of the retention, even if it wasn't read
+ * yet.
+ */
+void drop_used_storage(void)
+{
+    while (storage && storage != last_storage && expired_storage()) {
+        struct storage_t *s = storage;
+        long long pos = reader_in(s);
+
+        if (pos != -1) {
+            /*
+             * Let the readers finish the packets they're in, cut the rest
+             * and start the next storage on a packet boundary.
+             */
+            pos = MAX(pos, storage_start(s));
+            if (storage_end(s) - pos < TS_PACKET)
+                break;
+
+            int end = storage_boundary(s, pos - s->base);
+            if (end > pos - s->base) {
+                evicted += unread(s->base + end, storage_end(s));
+                s->offw = end;
+                resync_storage(s->next);
+                break;
+            }
+        }
+
+        evicted += unread(storage_start(s), storage_end(s));
+        drop_storage();
+        if (pos != -1)
+            resync_storage(storage);
+    }
+}
+
+/**
+ * Free some space according to the overflow policy. Storage all the readers
+ * are past goes first, then the oldest unread one. No reader may be in
+ * the one evicted, nor in the ones around it, so that the gap can be cut on
+ * packet boundaries without touching what the readers are in.
+ * \return 0 if there was nothing to evict.
+ */
+int evict_storage(void)
+{
+    if (overflow != OVERFLOW_DROP || !storage || storage == last_storage)
+        return 0;
+
+    struct storage_t *s;
+
+    if (storage_end(storage) <= min_reader_pos()) {
+        s = storage;
+        storage = s->next;
+        index_drop_first();
+    } else {
+        struct storage_t *keep = storage;
+        while (1) {
+            s = keep->next;
+            if (!s || s == last_storage)
+                return 0;
+            if (reader_in(keep) == -1 && reader_in(s) == -1 &&
+                    reader_in(s->next) == -1)
+                break;
+            keep = s;
+        }
+
+        keep->next = s->next;
+        index_remove(s);
+        evicted += unread(storage_start(s), storage_end(s));
+
+        int end = storage_last_boundary(keep, keep->offr);
+        evicted += unread(keep->base + end, storage_end(keep));
+        keep->offw = end;
+
+        resync_storage(keep->next);
+    }
+
+    /* Really free the space, don't pool it. */
+    sync_storage(s, s->offq);
+    nstorage--;
+    destroy_storage(s);
+
+    return 1;
+}
+
+/**
+ * Make sure the last storage has room, alloc a new one if needed and evict
+ * old ones if the disk is full.
+ * \return 0 on success, -1 if there's no room.
+ */
+int next_storage(void)
+{
+    struct storage_t *s = last_storage;
+
+    /* Data not stored was skipped in the ring, start a new storage. */
+    if (s && !s->offw)
+        s->base = ring.tail;
+    if (s && s->offw < chunksize && storage_end(s) == ring.tail)
+        return 0;
+
+    if (disk_full)
+        return -1;
+
+    while (alloc_storage() == -1)
+        if (!evict_storage()) {
+            disk_full = 1;
+            return -1;
+        }
+
+    return 0;
+}
+
+/**
+ * Get the place in the last storage where up to *sz bytes can be written
+ * directly, alloc it if needed. Follow with commit_storage.
+ * \return The pointer, or 0 if the storage isn't mapped.
+ */
+char *storage_space(int *sz)
+{
+    if (next_storage() == -1)
+        return 0;
+
+    struct storage_t *s = last_storage;
+    if (!s->map)
+        return 0;
+
+    *sz = MIN(*sz, chunksize - s->offw);
+    return s->map + s->offw;
+}
+
+/**
+ * Account sz bytes appended to a storage. The ring tail follows the end of
+ * the storage, and the head too if the data didn't go through the ring.
+ */
+void append_storage(struct storage_t *s, int sz)
+{
+    s->offw += sz;
+    ring.tail += sz;
+    ring.head = MAX(ring.head, ring.tail);
+}
+
+/**
+ * Account sz bytes written directly to the last storage.
+ */
+void commit_storage(int sz)
+{
+    struct storage_t *s = last_storage;
+
+    append_storage(s, sz);
+
+    /* Nobody is going to read this one soon, don't keep it mapped in. */
+    if (s->offw == chunksize && reader_in(s) == -1)
+        release_storage(s, chunksize);
+}
+
+/**
+ * Write the data to one storage, alloc it if needed.
+ * \return The amount of data that actually fit into this storage, 0 if the
+ * disk is full.
+ */
+int do_storage_write(const char *buf, int bufsz)
+{
+    if (next_storage() == -1)
+        return 0;
+
+    struct storage_t *s = last_storage;
+    const char *p = buf;
+    int sz;
+
+    if (s->map) {
+        sz = MIN(chunksize - s->offw, bufsz);
+        memcpy(s->map + s->offw, buf, sz);
+        commit_storage(sz);
+        return sz;
+    }
+
+    /* A full disk only shows up after the fact with these, and leaves a
+     * hole. They're for reserved storages, the others are written here. */
+    if (uring.fd != -1 && s->reserved) {
+        sz = MIN(chunksize - s->offw, bufsz);
+        uring_write(s, s->offw, buf, sz);
+        append_storage(s, sz);
+        return sz;
+    }
+
+    if (use_threads && s->reserved) {
+        sz = MIN(chunksize - s->offw, bufsz);
+        thread_write(s, s->offw, buf, sz);
+        append_storage(s, sz);
+        return sz;
+    }
+
+    while (s->offw < chunksize && (p - buf) < bufsz) {
+        int towr = MIN(chunksize - s->offw, bufsz - (p - buf));
+        sz = pwrite(s->fd, p, towr, s->offw);
+        if (sz == -1) {
+            if (errno != ENOSPC)
+                perror("write"), abort();
+            if (!evict_storage()) {
+                disk_full = 1;
+                break;
+            }
+            continue;
+        }
+        p += sz;
+        append_storage(s, sz);
+    }
+
+    return p - buf;
+}
+
+/**
+ * Write the data to the storage chunks.
+ * \return The amount of data written, less than bufsz if the disk is full.
+ */
+int write_chunks(const char *buf, int bufsz)
+{
+    const char *p = buf;
+
+    while ((p - buf) < bufsz) {
+        int sz = do_storage_write(p, bufsz - (p - buf));
+        if (!sz)
+            break;
+        p += sz;
+    }
+
+    return p - buf;
+}
+
+/**
+ * Map the cache file as the ring. A regular file is preallocated to the
+ * cache size, a block device is used whole.
+ */
+void map_cachefile(void)
+{
+    int fd = open(cachefile, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        perror("open"), abort();
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        perror("fstat"), abort();
+
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t sz;
+        if (ioctl(fd, BLKGETSIZE64, &sz) == -1)
+            perror("ioctl"), abort();
+        ring.size = sz;
+    } else if (cachesize) {
+        ring.size = cachesize;
+        if (st.st_size < ring.size && fallocate(fd, 0, 0, ring.size) == -1 &&
+                ftruncate(fd, ring.size) == -1)
+            perror("ftruncate"), abort();
+    } else {
+        ring.size = st.st_size;
+    }
+
+    /* Whole pages only, so that the consumed ones can be released. */
+    ring.size &= ~(long long) (getpagesize() - 1);
+    if (!ring.size)
+        fprintf(stderr, "Cache file size not specified\n"), exit(-1);
+
+    ring.buf = mmap(0, ring.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring.buf == MAP_FAILED)
+        perror("mmap"), abort();
+    close(fd);
+
+    madvise(ring.buf, ring.size, MADV_SEQUENTIAL);
+}
+
+/**
+ * Allocate the ring. The RAM tier lives in a memfd, on hugepages if asked
+ * to, and is locked in memory so that it never page faults.
+ */
+void alloc_ring(void)
+{
+    if (cachefile) {
+        map_cachefile();
+        return;
+    }
+
+    ring.buf = MAP_FAILED;
+
+    if (use_hugepages) {
+        ring.size = (ring.size + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE *
+            HUGEPAGE_SIZE;
+        int fd = memfd_create("timeshift", MFD_CLOEXEC | MFD_HUGETLB);
+        if (fd != -1) {
+            if (ftruncate(fd, ring.size) == 0)
+                ring.buf = mmap(0, ring.size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, 0);
+            close(fd);
+        }
+        if (ring.buf == MAP_FAILED)
+            fprintf(stderr, "Hugepages not available, not using them\n");
+    }
+
+    if (ring.buf == MAP_FAILED) {
+        int fd = memfd_create("timeshift", MFD_CLOEXEC);
+        if (fd == -1)
+            perror("memfd_create"), abort();
+        if (ftruncate(fd, ring.size) == -1)
+            perror("ftruncate"), abort();
+        ring.buf = mmap(0, ring.size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, 0);
+        if (ring.buf == MAP_FAILED)
+            perror("mmap"), abort();
+        close(fd);
+    }
+
+    if (mlock(ring.buf, ring.size) == -1)
+        fprintf(stderr, "Can't lock the RAM tier in memory\n");
+}
+
+/**
+ * Give the consumed pages of the cache file back to the kernel, like
+ * release_storage does for chunks.
+ */
+void release_ring(void)
+{
+    if (!cachefile)
+        return;
+
+    long long off = ring.tail & ~(long long) (getpagesize() - 1);
+    if (off - ring.offd < RELEASE_SIZE)
+        return;
+
+    /* Wrap around at the end of the file, no more than one lap. */
+    ring.offd = MAX(ring.offd, off - ring.size);
+    while (ring.offd < off) {
+        long long start = ring.offd % ring.size;
+        long long len = MIN(off - ring.offd, ring.size - start);
+        if (madvise(ring.buf + start, len, MADV_DONTNEED) == -1)
+            perror("madvise"), abort();
+        ring.offd += len;
+    }
+}
+
+/**
+ * Move the sz oldest bytes from the RAM tier to the storage chunks.
+ * \return The amount of data moved, less than sz if the disk is full.
+ */
+int flush_ring(int sz)
+{
+    int done = 0;
+
+    while (done < sz) {
+        long long off = ring.tail % ring.size;
+        int n = MIN(sz - done, ring.size - off);
+        n = write_chunks(ring.buf + off, n);
+        done += n;
+        if (!n)
+            break;
+    }
+
+    return done;
+}
+
+/**
+ * Copy sz bytes of the ring starting at stream position pos.
+ */
+void copy_ring(long long pos, char *buf, int sz)
+{
+    while (sz > 0) {
+        long long off = pos % ring.size;
+        int n = MIN(sz, ring.size - off);
+        memcpy(buf, ring.buf + off, n);
+        pos += n;
+        buf += n;
+        sz -= n;
+    }
+}
+
+/**
+ * Find the first TS packet boundary in the ring at or after pos.
+ * \return Its position, or -1 if there is none.
+ */
+long long ring_boundary(long long pos)
+{
+    char buf[2 * TS_PACKET];
+
+    int sz = MIN(ring.head - pos, (long long) sizeof(buf));
+    if (sz <= 0)
+        return -1;
+
+    copy_ring(pos, buf, sz);
+    int b = ts_boundary(buf, sz);
+    return (b == -1) ? -1 : pos + b;
+}
+
+/**
+ * Make room in a full ring that is the only storage by dropping the oldest
+ * whole packets. The rest of the packet the slowest readers are in is moved
+ * over the dropped ones, so that they still get it whole. The other readers
+ * there skip to the next packet.
+ */
+void drop_ring(void)
+{
+    int sz = MIN(ring.size, IO_SIZE) / TS_PACKET * TS_PACKET;
+    long long tail = ring.tail;
+    long long b = ring_boundary(tail);
+    int part = 0;
+
+    if (sz && b != -1 && b - tail + sz <= ring.size) {
+        char buf[TS_PACKET];
+        part = b - tail;
+        copy_ring(tail, buf, part);
+        ring.tail += sz;
+        for (int i = 0; i < part; i++)
+            ring.buf[(ring.tail + i) % ring.size] = buf[i];
+    } else {
+        sz = MIN(ring.size, IO_SIZE);
+        ring.tail += sz;
+    }
+
+    evicted += sz;
+
+    for (struct reader_t *r = readers; r; r = r->next)
+        if (r->pos < ring.tail)
+            r->pos = (r->pos == tail) ? ring.tail : ring.tail + part;
+}
+
+/**
+ * Write the data to the RAM tier, flushing the oldest data to the storage
+ * chunks if it's full.
+ * \return The amount of data written, less than bufsz if there's no room.
+ */
+int write_ring(const char *buf, int bufsz)
+{
+    int done = 0;
+
+    while (done < bufsz) {
+        if (ring.head - ring.tail == ring.size) {
+            if (!cachedir && overflow == OVERFLOW_BLOCK)
+                break;
+            else if (!cachedir)
+                drop_ring();
+            else if (!flush_ring(MIN(ring.size, IO_SIZE)))
+                break;
+        }
+
+        long long off = ring.head % ring.size;
+        int n = MIN(bufsz - done, ring.size - off);
+        n = MIN(n, ring.size - (ring.head - ring.tail));
+        memcpy(ring.buf + off, buf + done, n);
+        ring.head += n;
+        done += n;
+
+        if (disk_full && cachedir && overflow == OVERFLOW_BLOCK)
+            blocked += n;
+        else if (disk_full && cachedir)
+            spilled += n;
+    }
+
+    return done;
+}
+
+/**
+ * Take back the last partial TS packet stored, if no reader has read it yet.
+ * \return The amount of data taken back.
+ */
+int unstore_partial(void)
+{
+    if (ring.size && ring.head != ring.tail) {
+        long long from = MAX(ring.tail, ring.head - 2 * TS_PACKET);
+        from = MAX(from, reader_between(ring.tail, ring.head + 1));
+        long long b = ring_boundary(from);
+        if (b == -1)
+            return 0;
+
+        int part = (ring.head - b) % TS_PACKET;
+        ring.head -= part;
+        return part;
+    }
+
+    struct storage_t *s = last_storage;
+    if (!s || storage_end(s) != ring.tail)
+        return 0;
+
+    long long pos = reader_between(storage_start(s), storage_end(s) + 1);
+    int end = storage_last_boundary(s, MAX(s->offr, pos - s->base));
+    int part = s->offw - end;
+    s->offw = end;
+    ring.head = ring.tail = storage_end(s);
+    return part;
+}
+
+/**
+ * Write all the data to the storage. What doesn't fit is dropped on packet
+ * boundaries: the partial packet stored last is taken back and the input
+ * resyncs on the next packet.
+ */
+void write_storage(const char *buf, int bufsz)
+{
+    if (resync) {
+        int b = ts_boundary(buf, bufsz);
+        if (b > 0) {
+            dropped += b;
+            buf += b;
+            bufsz -= b;
+        }
+        resync = 0;
+    }
+
+    int sz;
+    if (ring.size && (write_behind || !cachedir || ring.head != ring.tail))
+        sz = write_ring(buf, bufsz);
+    else if (ring.size)
+        sz = write_chunks(buf, bufsz), sz += write_ring(buf + sz, bufsz - sz);
+    else
+        sz = write_chunks(buf, bufsz);
+
+    if (sz < bufsz) {
+        dropped += bufsz - sz + unstore_partial();
+        resync = 1;
+    }
+}
+
+/**
+ * Whether there's room for another block of input. With the block policy
+ * the input waits when there isn't.
+ */
+int storage_room(void)
+{
+    if (overflow != OVERFLOW_BLOCK || (cachedir && !disk_full))
+        return 1;
+
+    return ring.size && ring.size - (ring.head - ring.tail) >= IO_SIZE;
+}
+
+/**
+ * Find the storage a reader is in, moving it over what was cut off.
+ * \return The storage, or 0 if the reader is past all of them.
+ */
+struct storage_t *reader_storage(struct reader_t *r)
+{
+    r->pos = data_pos(r->pos);
+    return find_storage(r->pos);
+}
+
+/**
+ * Return if there is data available to a reader in the storage chunks.
+ */
+int chunks_available(struct reader_t *r)
+{
+    drop_used_storage();
+
+    struct storage_t *s = reader_storage(r);
+    if (s)
+        return storage_end(s) - r->pos;
+    else
+        return 0;
+}
+
+/**
+ * Return if there is data available to a reader. Data in the chunks is
+ * older than data in the RAM tier, so that comes first.
+ */
+int data_available(struct reader_t *r)
+{
+    int sz = chunks_available(r);
+    if (sz)
+        return sz;
+
+    return MIN(ring.head - r->pos, INT_MAX);
+}
+
+/**
+ * Return how much data a reader can take now: in the storage chunks, only
+ * what is in the files already and not still queued to be written there.
+ */
+int data_ready(struct reader_t *r)
+{
+    int sz = chunks_available(r);
+    if (!sz)
+        return data_available(r);
+
+    struct storage_t *s = reader_storage(r);
+    return MAX(MIN(sz, s->base + storage_synced(s) - r->pos), 0);
+}
+
+/**
+ * Return if there is data available to any output. Recordings are finished
+ * separately when the outputs are done.
+ */
+int any_data_available(void)
+{
+    for (struct reader_t *r = readers; r; r = r->next)
+        if (!r->record && data_available(r))
+            return 1;
+    return 0;
+}
+
+/**
+ * Get a pointer to the data in storage without copying it. Does not
+ * advance the read offset.
+ * \return The amount of data available there, 0 if the storage isn't
+ * mapped.
+ */
+int peek_storage(struct reader_t *r, const char **buf, int bufsz)
+{
+    if (chunks_available(r)) {
+        struct storage_t *s = reader_storage(r);
+        if (!s->map)
+            return 0;
+
+        *buf = s->map + (r->pos - s->base);
+        return MIN(storage_end(s) - r->pos, bufsz);
+    }
+
+    if (ring.head == r->pos)
+        fprintf(stderr, "No storage to read from!\n"), abort();
+
+    long long off = r->pos % ring.size;
+    *buf = ring.buf + off;
+    return MIN(MIN(ring.head - r->pos, ring.size - off), bufsz);
+}
+
+/**
+ * Read data from storage. Does not advance the read offset.
+ * \return The amount of data read.
+ */
+int read_storage(struct reader_t *r, char *buf, int bufsz)
+{
+    if (chunks_available(r)) {
+        struct storage_t *s = reader_storage(r);
+        return read_chunk(s, r->pos - s->base, buf, bufsz);
+    }
+
+    const char *p;
+    int sz = peek_storage(r, &p, bufsz);
+    memcpy(buf, p, sz);
+    return sz;
+}
+
+/**
+ * Let go of the ring data all the readers are past. With the retention it's
+ * kept in the storage as already read.
+ */
+void consume_ring(void)
+{
+    long long pos = MIN(min_reader_pos(), ring.head);
+    if (!ring.size || pos <= ring.tail)
+        return;
+
+    int sz = MIN(pos - ring.tail, INT_MAX);
+
+    /* Keep it for rewinding. What doesn't fit is gone. */
+    if (cachedir && (cachesize || cachetime))
+        sz -= flush_ring(sz);
+
+    ring.tail += sz;
+    release_ring();
+}
+
+/**
+ * Advance read offset.
+ */
+void advance_storage(struct reader_t *r, int sz)
+{
+    while (sz > 0) {
+        int n = MIN(data_available(r), sz);
+        if (!n)
+            fprintf(stderr, "No storage to advance!\n"), abort();
+
+        struct storage_t *s = reader_storage(r);
+        r->pos += n;
+        sz -= n;
+
+        if (s) {
+            long long pos = MIN(min_reader_pos(), storage_end(s));
+            if (pos > s->base)
+                release_storage(s, pos - s->base);
+        }
+    }
+
+    consume_ring();
+}
+
+/**
+ * Advance the read offset over sz bytes of data, possibly spanning several
+ * storages.
+ */
+void skip_storage(struct reader_t *r, int sz)
+{
+    while (sz > 0) {
+        /* Less can be there if some was dropped on overflow. */
+        int n = MIN(data_available(r), sz);
+        if (!n)
+            return;
+
+        advance_storage(r, n);
+        sz -= n;
+    }
+}
+
+/**
+ * Move up to max bytes from the pipe fd directly to the storage.
+ * \return The amount of data moved, 0 on end of file, -1 on error.
+ */
+int splice_to_storage(int fd, int max)
+{
+    if (next_storage() == -1) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    struct storage_t *s = last_storage;
+    loff_t off = s->offw;
+
+    int sz = splice(fd, 0, s->fd, &off, MIN(chunksize - s->offw, max),
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (sz > 0)
+        append_storage(s, sz);
+
+    return sz;
+}
+
+/**
+ * Move up to max bytes from storage directly to the pipe fd. Does not
+ * advance the read offset.
+ * \return The amount of data moved, -1 on error.
+ */
+int splice_from_storage(struct reader_t *r, int fd, int max)
+{
+    struct storage_t *s = reader_storage(r);
+    if (!s)
+        fprintf(stderr, "No storage to read from!\n"), abort();
+
+    loff_t off = r->pos - s->base;
+    int len = MIN(storage_end(s) - r->pos, max);
+
+    /* The data must be in the file before the kernel can move it. The
+     * outputs only ask for what is there already. */
+    sync_storage(s, off + len);
+
+    s->spliced = 1;
+    return splice(s->fd, &off, fd, 0, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+/**
+ * Copy up to sz bytes of the stream starting at pos, from the storages and
+ * the ring.
+ * \return The amount copied, less than sz at the end or at a cut.
+ */
+int copy_stream(long long pos, char *buf, int sz)
+{
+    int done = 0;
+
+    while (done < sz) {
+        long long at = pos + done;
+        struct storage_t *s = find_storage(at);
+        int n;
+
+        if (s && storage_start(s) <= at) {
+            n = read_chunk(s, at - s->base, buf + done, sz - done);
+        } else if (!s && ring.size && at >= ring.tail && at < ring.head) {
+            n = MIN(sz - done, ring.head - at);
+            copy_ring(at, buf + done, n);
+        } else {
+            break;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+/**
+ * Find the first TS packet boundary in the stream at or after pos.
+ * \return Its position, or -1 if there is none.
+ */
+long long stream_boundary(long long pos)
+{
+    char buf[2 * TS_PACKET];
+
+    int b = ts_boundary(buf, copy_stream(pos, buf, sizeof(buf)));
+    return (b == -1) ? -1 : pos + b;
+}
+
+/**
+ * Find the start of the TS packet pos is in from the data before it, for
+ * when the rest of the packet didn't come yet.
+ * \return Its position, or -1 if there is no boundary before pos.
+ */
+long long packet_start(long long pos)
+{
+    long long b = stream_boundary(data_pos(MAX(oldest_pos(),
+                    pos - 2 * TS_PACKET)));
+    if (b == -1 || b > pos)
+        return -1;
+    return b + (pos - b) / TS_PACKET * TS_PACKET;
+}
+
+/**
+ * Whether FICLONERANGE is worth trying, until it isn't supported.
+ */
+int use_clone = 1;
+
+/**
+ * Append len bytes of a storage file at off to the file fd, in the kernel.
+ * Ranges aligned on both sides are cloned, the rest goes by copy_file_range,
+ * which reflinks too where it can, or by sendfile across filesystems. The
+ * data must be in the storage file already.
+ * \return The amount of data copied, -1 on error.
+ */
+ssize_t clone_storage(int fd, struct storage_t *s, loff_t off, size_t len)
+{
+    off_t at;
+
+    if (use_clone && len >= CLONE_BLOCK && !(off % CLONE_BLOCK) &&
+            (at = lseek(fd, 0, SEEK_CUR)) != -1 && !(at % CLONE_BLOCK)) {
+        struct file_clone_range fcr = {
+            .src_fd = s->fd,
+            .src_offset = off,
+            .src_length = len - len % CLONE_BLOCK,
+            .dest_offset = at,
+        };
+
+        if (ioctl(fd, FICLONERANGE, &fcr) == 0) {
+            if (lseek(fd, fcr.src_length, SEEK_CUR) == -1)
+                perror("lseek"), abort();
+            return fcr.src_length;
+        }
+        if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV)
+            use_clone = 0;
+    }
+
+    ssize_t sz = copy_file_range(s->fd, &off, fd, 0, len, 0);
+    if (sz == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                errno == EOPNOTSUPP))
+        sz = sendfile(fd, s->fd, &off, len);
+    return sz;
+}
+
+/**
+ * Copy up to max bytes from storage directly to a recording, in the kernel.
+ * Does not advance the read offset.
+ * \return The amount of data copied, -1 on error.
+ */
+int copy_from_storage(struct reader_t *r, int max)
+{
+    struct storage_t *s = reader_storage(r);
+    if (!s)
+        fprintf(stderr, "No storage to read from!\n"), abort();
+
+    int off = r->pos - s->base;
+    int len = MIN(storage_end(s) - r->pos, max);
+    sync_storage(s, off + len);
+
+    return clone_storage(r->fd, s, off, len);
+}
+
+/**
+ * Time index. Every INDEX_STEP ms of arrival, or INDEX_BYTES of input if
+ * that comes first, a mark maps a packet to its stream time and its arrival
+ * time, so seeking by time is a binary search. The stream time follows the
+ * PCRs of the first PID carrying them, and the arrival time where there are
+ * none or they jump.
+ */
+#define INDEX_STEP 100
+#define INDEX_BYTES (256 * 1024)
+
+/**
+ * How many packets of new input to look through for a PCR, and how far in
+ * ms the PCR may be ahead of the arrival time before it counts as a jump.
+ */
+#define INDEX_SCAN 64
+#define PCR_JUMP 10000
+
+struct mark_t {
+    long long pos;
+    long long stime, wtime;
+};
+
+struct {
+    struct mark_t *m;
+    int size;
+    int first, count;
+    long long pcr;
+    int pid;
+} marks = { 0, 0, 0, 0, -1, -1 };
+
+/**
+ * Wall clock time in ms.
+ */
+long long walltime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * The i-th mark in the time index.
+ */
+struct mark_t *mark_at(int i)
+{
+    return &marks.m[(marks.first + i) & (marks.size - 1)];
+}
+
+/**
+ * Add a mark at the end of the time index, growing it if it's full.
+ */
+void add_mark(long long pos, long long stime, long long wtime)
+{
+    if (marks.count == marks.size) {
+        int size = marks.size ? marks.size * 2 : 1024;
+        struct mark_t *a = malloc(size * sizeof(struct mark_t));
+        if (!a)
+            perror("malloc"), abort();
+
+        for (int i = 0; i < marks.count; i++)
+            a[i] = *mark_at(i);
+        free(marks.m);
+        marks.m = a;
+        marks.size = size;
+        marks.first = 0;
+    }
+
+    marks.count++;
+    struct mark_t *m = mark_at(marks.count - 1);
+    m->pos = pos;
+    m->stime = stime;
+    m->wtime = wtime;
+}
+
+/**
+ * Get the PCR of a TS packet.
+ * \return The PCR base in 90 kHz units, or -1 if the packet has none.
+ */
+long long ts_pcr(const unsigned char *p, int *pid)
+{
+    if (p[0] != TS_SYNC || !(p[3] & 0x20) || p[4] < 7 || !(p[5] & 0x10))
+        return -1;
+
+    *pid = ((p[1] & 0x1f) << 8) | p[2];
+    return ((long long) p[6] << 25) | (p[7] << 17) | (p[8] << 9) |
+        (p[9] << 1) | (p[10] >> 7);
+}
+
+/**
+ * Mark the new input in the time index when it's due. The mark goes on the
+ * first packet with a PCR in the new data, or on its first packet if there
+ * is none near. The input is looked at in the buffer it came in, the last
+ * insz bytes stored, or read back from the cache if it went there directly.
+ */
+void index_input(const char *in, int insz)
+{
+    static unsigned char scan[INDEX_SCAN * TS_PACKET];
+    const unsigned char *buf = scan;
+
+    long long now = walltime();
+    struct mark_t *last = marks.count ? mark_at(marks.count - 1) : 0;
+    if (last && now - last->wtime < INDEX_STEP &&
+            ring.head - last->pos < INDEX_BYTES)
+        return;
+
+    /* Drop the marks for what's gone, keeping one before the oldest data. */
+    long long oldest = oldest_pos();
+    while (marks.count > 1 && mark_at(1)->pos <= oldest) {
+        marks.first = (marks.first + 1) & (marks.size - 1);
+        marks.count--;
+    }
+
+    long long from = last ? data_pos(MAX(last->pos + 1,
+                ring.head - (long long) sizeof(scan))) : oldest;
+    int sz;
+    if (in && from < ring.head - insz && last)
+        from = ring.head - insz;
+    if (in && from >= ring.head - insz) {
+        buf = (const unsigned char *) in + insz - (ring.head - from);
+        sz = MIN(ring.head - from, (int) sizeof(scan));
+    } else {
+        sz = copy_stream(from, (char *) scan, sizeof(scan));
+    }
+
+    int b = ts_boundary((const char *) buf, sz);
+    if (b == -1) {
+        /* Not a transport stream, or not enough of it yet. */
+        if (sz < (int) sizeof(scan) && last)
+            return;
+        b = 0;
+    }
+
+    long long pos = from + b, pcr = -1;
+    for (int i = b; i + TS_PACKET <= sz; i += TS_PACKET) {
+        int pid;
+        long long p = ts_pcr(buf + i, &pid);
+        if (p != -1 && (marks.pid == -1 || pid == marks.pid)) {
+            marks.pid = pid;
+            pos = from + i;
+            pcr = p;
+            break;
+        }
+    }
+
+    if (!last) {
+        add_mark(pos, 0, now);
+        marks.pcr = pcr;
+        return;
+    }
+    if (pos <= last->pos)
+        return;
+
+    long long d = now - last->wtime;
+    if (pcr != -1 && marks.pcr != -1) {
+        long long pd = ((pcr - marks.pcr) & ((1LL << 33) - 1)) / 90;
+        if (pd <= d + PCR_JUMP)
+            d = pd;
+    }
+    if (pcr != -1)
+        marks.pcr = pcr;
+
+    add_mark(pos, last->stime + d, now);
+}
+
+/**
+ * Find the last mark at or before a stream position.
+ * \return Its index, or 0 if pos is before all of them.
+ */
+int mark_by_pos(long long pos)
+{
+    int lo = 0, hi = marks.count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (mark_at(mid)->pos <= pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return MAX(lo - 1, 0);
+}
+
+/**
+ * Stream time of a position in ms, interpolated between the marks around
+ * it, or carried on from the last two past them.
+ */
+long long stream_time(long long pos)
+{
+    if (!marks.count)
+        return 0;
+
+    int i = mark_by_pos(pos);
+    if (i + 1 == marks.count)
+        i--;
+    if (i < 0 || pos <= mark_at(i)->pos)
+        return mark_at(MAX(i, 0))->stime;
+
+    struct mark_t *m = mark_at(i), *n = mark_at(i + 1);
+    return m->stime + (n->stime - m->stime) * (pos - m->pos) /
+        (n->pos - m->pos);
+}
+
+/**
+ * Stream position at a time, stream or arrival, interpolated between the
+ * marks around it.
+ * \return The position, or -1 if there are no marks.
+ */
+long long time_pos(long long t, int wall)
+{
+    int lo = 0, hi = marks.count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct mark_t *m = mark_at(mid);
+        if ((wall ? m->wtime : m->stime) < t)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (!marks.count)
+        return -1;
+    if (!lo)
+        return mark_at(0)->pos;
+
+    /* After the last mark, what came since arrived by now. */
+    struct mark_t now = { ring.head, 0, walltime() };
+    if (lo == marks.count && (!wall || t >= now.wtime))
+        return ring.head;
+
+    struct mark_t *p = mark_at(lo - 1);
+    struct mark_t *n = (lo == marks.count) ? &now : mark_at(lo);
+    long long pt = wall ? p->wtime : p->stime, nt = wall ? n->wtime : n->stime;
+    return p->pos + (n->pos - p->pos) * (t - pt) / MAX(nt - pt, 1);
+}
+
+/**
+ * Event watch. One for every descriptor the event loop cares about.
+ */
+struct watch_t {
+    struct watch_t *next;
+
+    int fd;
+    uint32_t events;
+    int pollable;
+    void (*handler)(struct watch_t *w, uint32_t revents);
+    void *data;
+};
+
+int epfd = -1;
+struct watch_t *watches = 0;
+
+/**
+ * Create the epoll instance.
+ */
+void init_events(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        perror("epoll_create1"), abort();
+}
+
+/**
+ * Register a watch for fd. It starts with no events wanted.
+ */
+void add_watch(struct watch_t *w, int fd,
+        void (*handler)(struct watch_t *w, uint32_t revents))
+{
+    w->fd = fd;
+    w->events = 0;
+    w->handler = handler;
+    w->pollable = 1;
+
+    struct epoll_event ev = { .events = 0, .data.ptr = w };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        /* Regular files can't be polled, they are always ready. */
+        if (errno == EPERM)
+            w->pollable = 0;
+        else
+            perror("epoll_ctl"), abort();
+    }
+
+    w->next = watches;
+    watches = w;
+}
+
+/**
+ * Change the set of events a watch is interested in.
+ */
+void set_watch(struct watch_t *w, uint32_t events)
+{
+    if (w->events == events)
+        return;
+    w->events = events;
+
+    if (!w->pollable)
+        return;
+
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, w->fd, &ev) == -1)
+        perror("epoll_ctl"), abort();
+}
+
+/**
+ * Unregister a watch.
+ */
+void del_watch(struct watch_t *w)
+{
+    if (w->pollable && epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, 0) == -1)
+        perror("epoll_ctl"), abort();
+
+    struct watch_t **wp = &watches;
+    while (*wp && *wp != w)
+        wp = &(*wp)->next;
+    if (*wp)
+        *wp = w->next;
+}
+
+/**
+ * Point a watch at another descriptor, keeping its place and events.
+ */
+void move_watch(struct watch_t *w, int fd)
+{
+    if (w->pollable && epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, 0) == -1)
+        perror("epoll_ctl"), abort();
+
+    w->fd = fd;
+    w->pollable = 1;
+
+    struct epoll_event ev = { .events = w->events, .data.ptr = w };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        if (errno == EPERM)
+            w->pollable = 0;
+        else
+            perror("epoll_ctl"), abort();
+    }
+}
+
+/**
+ * Make a timer fire every ms milliseconds, or stop it if ms is 0.
+ */
+void set_timer(struct watch_t *w, int ms)
+{
+    struct itimerspec its;
+    its.it_interval.tv_sec = its.it_value.tv_sec = ms / 1000;
+    its.it_interval.tv_nsec = its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    if (timerfd_settime(w->fd, 0, &its, 0) == -1)
+        perror("timerfd_settime"), abort();
+}
+
+/**
+ * Register a periodic timer firing every ms milliseconds, or a stopped one
+ * if ms is 0.
+ */
+void add_timer(struct watch_t *w, int ms,
+        void (*handler)(struct watch_t *w, uint32_t revents))
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+        perror("timerfd_create"), abort();
+
+    add_watch(w, fd, handler);
+    set_watch(w, EPOLLIN);
+    set_timer(w, ms);
+}
+
+/**
+ * Make a wall clock timer fire once at ms milliseconds since the epoch,
+ * right away if that's past, or stop it if ms is 0.
+ */
+void set_alarm(struct watch_t *w, long long ms)
+{
+    struct itimerspec its = { { 0, 0 }, { ms / 1000, (ms % 1000) * 1000000 } };
+    if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, 0) == -1)
+        perror("timerfd_settime"), abort();
+}
+
+/**
+ * Register a wall clock timer firing once at ms milliseconds since the
+ * epoch.
+ */
+void add_alarm(struct watch_t *w, long long ms,
+        void (*handler)(struct watch_t *w, uint32_t revents))
+{
+    int fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1)
+        perror("timerfd_create"), abort();
+
+    add_watch(w, fd, handler);
+    set_watch(w, EPOLLIN);
+    set_alarm(w, ms);
+}
+
+/**
+ * Wait for events and dispatch them to the handlers.
+ */
+void run_events(void)
+{
+    struct watch_t *w;
+    int timeout = -1;
+
+    /* Don't sleep if an unpollable descriptor wants something. */
+    for (w = watches; w; w = w->next)
+        if (!w->pollable && w->events)
+            timeout = 0;
+
+    struct epoll_event evs[16];
+    int n = epoll_wait(epfd, evs, 16, timeout);
+    if (n == -1 && errno != EINTR)
+        perror("epoll_wait"), abort();
+
+    for (int i = 0; i < n; i++) {
+        w = evs[i].data.ptr;
+        w->handler(w, evs[i].events);
+    }
+
+    /* A handler may remove its own watch. */
+    struct watch_t *next;
+    for (w = watches; w; w = next) {
+        next = w->next;
+        if (!w->pollable && w->events)
+            w->handler(w, w->events);
+    }
+}
+
+int in = 1;
+struct watch_t inw, poolw, retryw, wakew, uringw, sigw;
+
+/**
+ * Whether the input is a pipe we can splice from.
+ */
+int splice_in = 0;
+
+/**
+ * Fill the storage pool, one file per tick, so that the startup isn't
+ * delayed by it. It stops once the pool is full, or the disk; dropped
+ * storages fill the pool then.
+ */
+void prewarm_pool(struct watch_t *w, uint32_t revents)
+{
+    uint64_t n;
+    if (read(w->fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        perror("read"), abort();
+
+    struct storage_t *s = 0;
+    if (pooled < POOL_SIZE && (s = create_storage()))
+        pool_storage(s);
+
+    if (pooled == POOL_SIZE || !s) {
+        del_watch(w);
+        close(w->fd);
+    }
+}
+
+/**
+ * Retry writing to a full cache and flush what was kept in memory.
+ */
+void retry_overflow(struct watch_t *w, uint32_t revents)
+{
+    uint64_t n;
+    if (read(w->fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        perror("read"), abort();
+
+    disk_full = 0;
+    if (cachedir && ring.size && !write_behind)
+        flush_ring(ring.head - ring.tail);
+}
+
+/**
+ * A worker thread has done a job: the recorder has made room in its queue,
+ * or the writer has put more of the cache in the files for the outputs.
+ * Only wakes up the loop.
+ */
+void queue_wake(struct watch_t *w, uint32_t revents)
+{
+    uint64_t n;
+    if (read(w->fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        perror("read"), abort();
+}
+
+/**
+ * io_uring has finished writes, the outputs waiting for them can go on.
+ */
+void uring_wake(struct watch_t *w, uint32_t revents)
+{
+    uint64_t n;
+    if (read(w->fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        perror("read"), abort();
+    uring_reap();
+}
+
+/**
+ * Whether an output can be written to now. Only a recording can't, when the
+ * recorder thread's queue is full.
+ */
+int reader_room(struct reader_t *r)
+{
+    return !r->record || !use_threads || queue_room(&recorder);
+}
+
+/**
+ * Queue the same data for n recordings to the recorder thread, copied once
+ * for all of them, as much as there's room for in its queue.
+ * \return The amount of data queued, -1 if there's no room.
+ */
+int record_write(struct reader_t **rs, int n, const char *buf, int sz)
+{
+    struct job_t *j;
+    int done = 0;
+    while (done < sz && (j = queue_get(&recorder, 0))) {
+        j->len = MIN(sz - done, IO_SIZE);
+        j->nfds = n;
+        for (int i = 0; i < n; i++)
+            j->fds[i] = rs[i]->fd;
+        memcpy(j->data, buf + done, j->len);
+        queue_push(&recorder);
+        done += j->len;
+    }
+
+    if (!done) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return done;
+}
+
+/**
+ * Write to an output. Recordings go to the recorder thread if there is one.
+ * \return The amount of data written, -1 on error.
+ */
+int reader_write(struct reader_t *r, const char *buf, int sz)
+{
+    if (!r->record || !use_threads)
+        return write(r->fd, buf, sz);
+    return record_write(&r, 1, buf, sz);
+}
+
+/**
+ * Close a recording's file, after what's queued for it is written.
+ */
+void record_close(int fd)
+{
+    if (!use_threads) {
+        close(fd);
+        return;
+    }
+
+    struct job_t *j = queue_get(&recorder, 1);
+    j->len = 0;
+    j->nfds = 1;
+    j->fds[0] = fd;
+    queue_push(&recorder);
+}
+
+/**
+ * Open part part of a recording: its name, then name.1, name.2 and so on.
+ * \return The file descriptor, -1 on error.
+ */
+int record_open(const char *name, int part)
+{
+    char path[strlen(name) + 12];
+    if (part)
+        sprintf(path, "%s.%d", name, part);
+    else
+        strcpy(path, name);
+
+    return open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+}
+
+/**
+ * Go on with a recording in its next part, from where it is. If that can't
+ * be created, it goes on in the current one.
+ */
+void rotate_recording(struct reader_t *r)
+{
+    int fd = record_open(r->name, r->part + 1);
+    r->start = r->pos;
+    if (fd == -1) {
+        perror("open");
+        return;
+    }
+
+    move_watch(r->w, fd);
+    record_close(r->fd);
+    r->fd = fd;
+    r->part++;
+}
+
+/**
+ * How much more a recording can take into its current part. Once it's
+ * past the rotation size or time, that's up to the next packet boundary,
+ * where it's rotated.
+ */
+int rotate_room(struct reader_t *r)
+{
+    if (!r->id || (!rotatesize && !rotatetime))
+        return INT_MAX;
+
+    reader_storage(r);
+    long long at = rotatesize ? r->start + rotatesize : LLONG_MAX;
+    if (rotatetime && stream_time(r->pos) - stream_time(r->start) >=
+            rotatetime * 1000LL)
+        at = r->pos;
+    if (r->pos < at)
+        return MIN(at - r->pos, INT_MAX);
+
+    /* Right here if it's not a TS. */
+    long long b = stream_boundary(r->pos);
+    if (b == -1 && ring.head - r->pos < 2 * TS_PACKET)
+        return 0;
+    if (b != -1 && b != r->pos)
+        return b - r->pos;
+
+    rotate_recording(r);
+    return rotate_room(r);
+}
+
+/**
+ * Whether an output has taken everything, so that new input can be handed
+ * to it directly.
+ */
+int caught_up(struct reader_t *r)
+{
+    if (r->paused || r->fd == -1 || r->seek != -1 || !reader_room(r))
+        return 0;
+
+    /* Recordings copy from the cache files instead. */
+    if (r->record && r->splice_out)
+        return 0;
+
+    return !data_available(r);
+}
+
+/**
+ * Hand freshly read data straight to an output, or to a recording up to
+ * where it rotates.
+ * \return The amount of data written.
+ */
+int handoff(struct reader_t *r, const char *buf, int sz)
+{
+    if (r->record) {
+        int room = rotate_room(r);
+        sz = MIN(sz, room);
+    }
+
+    int wsz = reader_write(r, buf, sz);
+    return MAX(wsz, 0);
+}
+
+/**
+ * Hand freshly stored data to the outputs that were waiting for it. The
+ * recordings that take all of it share the recorder jobs.
+ */
+void handoff_all(const char *buf, int sz)
+{
+    struct reader_t *group[MAX_RECORDINGS];
+    int n = 0;
+
+    for (struct reader_t *r = readers; r; r = r->next) {
+        if (!r->live)
+            continue;
+        if (r->record && use_threads && n < MAX_RECORDINGS &&
+                rotate_room(r) >= sz)
+            group[n++] = r;
+        else
+            skip_storage(r, handoff(r, buf, sz));
+    }
+
+    if (n) {
+        int wsz = record_write(group, n, buf, sz);
+        for (int i = 0; i < n; i++)
+            skip_storage(group[i], MAX(wsz, 0));
+    }
+}
+
+/**
+ * Tee input from the pipe fd straight to the output pipe, then splice the
+ * same data to the storage as already read.
+ * \return The amount of data moved, 0 if none, -1 on error.
+ */
+int tee_input(struct reader_t *r, int fd)
+{
+    static char buffer[IO_SIZE];
+
+    int sz = tee(fd, r->fd, IO_SIZE, SPLICE_F_NONBLOCK);
+    if (sz <= 0)
+        return sz;
+
+    for (int left = sz; left > 0; ) {
+        int ssz = splice_to_storage(fd, left);
+        if (ssz == -1 && errno == EINTR)
+            continue;
+        if (ssz <= 0) {
+            /* The data is there, so this only fails for the file. */
+            ssz = read(fd, buffer, MIN(left, IO_SIZE));
+            if (ssz <= 0)
+                perror("read"), abort();
+            write_storage(buffer, ssz);
+        }
+        left -= ssz;
+    }
+
+    skip_storage(r, sz);
+    return sz;
+}
+
+/**
+ * Input is ready, move it to the storage. If outputs are waiting for it,
+ * hand it over right away and keep it in the storage only for later.
+ */
+void ingest(struct watch_t *w, uint32_t revents)
+{
+    static char buffer[IO_SIZE];
+
+    for (int i = 0; i < IO_BUDGET; i++) {
+        int sz = IO_SIZE;
+        char *p, *fresh = 0;
+
+        if (!storage_room()) {
+            /* Wait for the outputs or the retry to make room. */
+            set_watch(w, 0);
+            return;
+        }
+
+        for (struct reader_t *r = readers; r; r = r->next)
+            r->live = caught_up(r);
+
+        /* A single output can take it without a copy. */
+        struct reader_t *tee_to = (readers && !readers->next &&
+                readers->live && readers->splice_out) ? readers : 0;
+
+        if (use_mmap && !ring.size && (p = storage_space(&sz))) {
+            sz = read(w->fd, p, sz);
+            if (sz > 0) {
+                commit_storage(sz);
+                handoff_all(p, sz);
+                fresh = p;
+            }
+        } else if (splice_in && !disk_full) {
+            sz = tee_to ? tee_input(tee_to, w->fd) : 0;
+            if (sz <= 0)
+                sz = splice_to_storage(w->fd, chunksize);
+            if (sz == -1 && errno != EINTR && errno != EAGAIN) {
+                /* Let the copying path deal with it. */
+                if (errno == EINVAL)
+                    splice_in = 0;
+                sz = read(w->fd, buffer, IO_SIZE);
+                if (sz > 0)
+                    write_storage(buffer, sz);
+            }
+        } else {
+            sz = read(w->fd, buffer, IO_SIZE);
+            if (sz > 0) {
+                /* Only hand it over whole, packets are cut if it's not. */
+                long long head = ring.head;
+                write_storage(buffer, sz);
+                if (ring.head - head == sz) {
+                    handoff_all(buffer, sz);
+                    fresh = buffer;
+                }
+            }
+        }
+
+        if (sz > 0)
+            index_input(fresh, sz);
+        if (sz == -1 && errno == EINTR)
+            continue;
+        if (sz == -1 && errno == EAGAIN)
+            return;
+        if (sz == -1 || sz == 0) {
+            del_watch(w);
+            in = 0;
+            return;
+        }
+    }
+}
+
+/**
+ * Remove an output whose consumer went away, or a finished recording.
+ */
+void del_reader(struct reader_t *r)
+{
+    struct reader_t **rp = &readers;
+    while (*rp != r)
+        rp = &(*rp)->next;
+    *rp = r->next;
+
+    if (r == recording)
+        recording = 0;
+    if (r == main_output)
+        main_output = 0;
+    if (!r->record)
+        noutputs--;
+
+    if (r->fd != -1)
+        del_watch(r->w);
+    free(r->w);
+    if (r->record)
+        record_close(r->fd);
+    else if (r->fd != -1)
+        close(r->fd);
+    free(r->name);
+    free(r);
+
+    consume_ring();
+}
+
+/**
+ * Jump to the seek target once the output got to the end of the packet it
+ * was in.
+ */
+void finish_seek(struct reader_t *r)
+{
+    if (r->seek == -1)
+        return;
+
+    reader_storage(r);
+    if (r->pos >= r->until) {
+        r->pos = r->seek;
+        r->seek = -1;
+    }
+}
+
+/**
+ * Whether a recording has got all it's meant to.
+ */
+int reader_done(struct reader_t *r)
+{
+    reader_storage(r);
+    return r->end != -1 && r->pos >= r->end;
+}
+
+/**
+ * Whether a recording waits for a batch. Only while it's in the newest
+ * chunk and that grows by a batch past it, anything else it has to take as
+ * it is, before it's gone or holds the rest of the cache.
+ */
+int record_batching(struct reader_t *r)
+{
+    if (!r->record || r->end != -1 || !r->splice_out || write_behind ||
+            disk_full)
+        return 0;
+
+    struct storage_t *s = reader_storage(r);
+    return s && s == last_storage &&
+        chunksize - (r->pos - s->base) >= RECORD_BATCH;
+}
+
+/**
+ * Whether an output has something to take.
+ */
+int reader_ready(struct reader_t *r)
+{
+    if (r->fd == -1 || !reader_room(r) || reader_done(r) ||
+            (r->record && !rotate_room(r)))
+        return 0;
+
+    /* A paused one still finishes the packet it's in. */
+    finish_seek(r);
+    if (r->paused && r->seek == -1)
+        return 0;
+
+    if (record_batching(r))
+        return data_ready(r) >= RECORD_BATCH;
+    return data_ready(r);
+}
+
+/**
+ * Feed an output from the storage. Recordings are fed here too, at their
+ * own pace. The budget counts bytes, as a copy in the kernel could take a
+ * whole chunk at once and hold up the loop.
+ * \return 0 when it's fed or can't take more now, -1 on error.
+ */
+int feed_reader(struct reader_t *r)
+{
+    static char buffer[IO_SIZE];
+    int done = 0;
+
+    for (int i = 0; i < IO_BUDGET && done < IO_BUDGET * IO_SIZE &&
+            reader_ready(r); i++) {
+        int max = MIN(data_ready(r), IO_BUDGET * IO_SIZE - done);
+        int wsz;
+
+        if (r->seek != -1)
+            max = MIN(max, r->until - r->pos);
+        if (r->end != -1)
+            max = MIN(max, r->end - r->pos);
+        if (r->record) {
+            int room = rotate_room(r);
+            max = MIN(max, room);
+        }
+
+        if (r->splice_out && chunks_available(r)) {
+            wsz = r->record ? copy_from_storage(r, max) :
+                splice_from_storage(r, r->fd, max);
+            if (wsz > 0)
+                advance_storage(r, wsz);
+            if (wsz == -1 && errno == EINVAL) {
+                r->splice_out = 0;
+                continue;
+            }
+        } else {
+            const char *p = buffer;
+            int sz = peek_storage(r, &p, MIN(IO_SIZE, max));
+            if (!sz)
+                sz = read_storage(r, buffer, MIN(IO_SIZE, max));
+            wsz = reader_write(r, p, sz);
+            if (wsz > 0)
+                advance_storage(r, wsz);
+        }
+
+        if (wsz > 0)
+            done += wsz;
+        if (wsz == -1 && errno == EINTR)
+            continue;
+        if (wsz == -1 && errno == EAGAIN)
+            return 0;
+        if (wsz == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Where the main output takes a new consumer from when the one it has goes
+ * away (-l): a FIFO, tried until someone opens it for reading, or a UNIX
+ * socket to connect to. Until then, the output keeps its position, like a
+ * paused one, and so the cache it didn't get yet.
+ */
+char *consumerpath = 0;
+int consumerfifo = 0;
+struct watch_t consumerw;
+
+/**
+ * The main output's consumer went away, wait for a new one. The next one
+ * starts from the start of the packet this one was in, or from where it
+ * was seeking to, and the output waits there, so that the retention can
+ * drop what's before it.
+ */
+void detach_output(struct reader_t *r)
+{
+    long long b;
+
+    del_watch(r->w);
+    close(r->fd);
+    r->fd = -1;
+    r->live = 0;
+    noutputs--;
+
+    reader_storage(r);
+    if (r->seek != -1)
+        r->pos = r->seek;
+    else if ((b = packet_start(r->pos)) != -1)
+        r->pos = b;
+    r->seek = -1;
+
+    if (consumerfifo)
+        set_timer(&consumerw, RETRY_INTERVAL);
+}
+
+/**
+ * Output is ready, feed it. An error or hangup is reported even when the
+ * output isn't waited for, its consumer is gone then.
+ */
+void egress(struct watch_t *w, uint32_t revents)
+{
+    struct reader_t *r = w->data;
+
+    if ((revents & (EPOLLERR | EPOLLHUP)) || feed_reader(r) == -1) {
+        if (r->record)
+            fprintf(stderr, "Recording error\n");
+        if (r == main_output && consumerpath)
+            detach_output(r);
+        else
+            del_reader(r);
+    }
+}
+
+/**
+ * Check whether fd is a pipe.
+ */
+int is_pipe(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/**
+ * Make fd non-blocking.
+ */
+void set_nonblock(int fd)
+{
+    int fl = fcntl(fd, F_GETFL);
+    if (fl == -1 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1)
+        perror("fcntl"), abort();
+}
+
+/**
+ * A new consumer for the main output. It's given to it only once the events
+ * at hand are dispatched, as one for the consumer it has may be among them,
+ * on the same watch.
+ */
+int next_consumer = -1;
+
+/**
+ * Give the main output a new consumer after the events at hand, the last
+ * one if there are more.
+ */
+void take_consumer(int fd)
+{
+    if (next_consumer != -1)
+        close(next_consumer);
+    next_consumer = fd;
+}
+
+/**
+ * Give the main output the new consumer, taking over from the one it has,
+ * if any. It goes on from where it was detached.
+ */
+void attach_output(void)
+{
+    int fd = next_consumer;
+    if (fd == -1)
+        return;
+    next_consumer = -1;
+
+    struct reader_t *r = main_output;
+
+    if (r->fd != -1)
+        detach_output(r);
+    if (consumerfifo)
+        set_timer(&consumerw, 0);
+
+    set_nonblock(fd);
+    r->fd = fd;
+    r->splice_out = is_pipe(fd);
+    add_watch(r->w, fd, egress);
+    noutputs++;
+}
+
+/**
+ * Add an output or a recording, reading from the oldest data there is.
+ */
+struct reader_t *add_reader(int fd, int record)
+{
+    struct reader_t *r = malloc(sizeof(struct reader_t));
+    struct watch_t *w = malloc(sizeof(struct watch_t));
+    if (!r || !w)
+        perror("malloc"), abort();
+
+    r->next = 0;
+    r->fd = fd;
+    r->pos = oldest_pos();
+    r->splice_out = record ? !use_threads : is_pipe(fd);
+    r->live = 0;
+    r->paused = 0;
+    r->seek = -1;
+    r->record = record;
+    r->end = -1;
+    r->id = 0;
+    r->part = 0;
+    r->name = 0;
+    r->w = w;
+    if (!record)
+        noutputs++;
+
+    set_nonblock(fd);
+    add_watch(w, fd, egress);
+    w->data = r;
+
+    struct reader_t **rp = &readers;
+    while (*rp)
+        rp = &(*rp)->next;
+    *rp = r;
+
+    return r;
+}
+
+/**
+ * Whether a reader is a recording that's still going.
+ */
+int is_recording(struct reader_t *r)
+{
+    return r->id && r->end == -1;
+}
+
+/**
+ * Stop a recording at stream position pos, on the start of the packet it's
+ * in, once it gets there.
+ */
+void stop_recording(struct reader_t *r, long long pos)
+{
+    if (r == recording)
+        recording = 0;
+
+    long long end = packet_start(pos);
+    r->end = (end != -1) ? end : pos;
+}
+
+/**
+ * Stop all recordings.
+ */
+void stop_recordings(void)
+{
+    for (struct reader_t *r = readers; r; r = r->next)
+        if (is_recording(r))
+            stop_recording(r, ring.head);
+}
+
+/**
+ * Finish the recordings that are still catching up, before exiting.
+ */
+void finish_recordings(void)
+{
+    stop_recordings();
+
+    struct reader_t *r, *next;
+    for (r = readers; r; r = next) {
+        next = r->next;
+        if (!r->record)
+            continue;
+
+        while (!reader_done(r) && data_available(r)) {
+            long long pos = r->pos;
+            if (!reader_room(r))
+                queue_drain(&recorder);
+            if (feed_reader(r) == -1) {
+                fprintf(stderr, "Recording error\n");
+                break;
+            }
+            /* What's left may be too short to find where to rotate. */
+            if (r->pos == pos && reader_room(r))
+                break;
+        }
+        del_reader(r);
+    }
+}
+
+/**
+ * Start a new recording into file name, or a new one in the recording dir
+ * if it's 0, from stream position from, or from the live edge if it's -1.
+ * It gets id, or a new one if that's 0.
+ * The recording reads the stream on its own, like an output, so what's
+ * behind the live edge is copied from the cache and the rest is written as
+ * it comes in. Any number of recordings can go on at once.
+ * \return The recording, or 0 on error.
+ */
+struct reader_t *start_recording_from(long long from, const char *name,
+        int id)
+{
+    char tmp[strlen(recorddir) + 20];
+    int fd;
+
+    if (name) {
+        fd = record_open(name, 0);
+    } else {
+        strcpy(tmp, recorddir);
+        strcat(tmp, "/recordXXXXXX");
+        fd = mkstemp(tmp);
+        name = tmp;
+    }
+    if (fd == -1)
+        return 0;
+
+    char *dup = strdup(name);
+    if (!dup)
+        perror("strdup"), abort();
+
+    long long pos = (from == -1) ? packet_start(ring.head) :
+        stream_boundary(data_pos(MAX(from, oldest_pos())));
+    struct reader_t *r = add_reader(fd, 1);
+    r->pos = (pos != -1) ? pos : (from == -1) ? ring.head :
+        data_pos(MAX(from, oldest_pos()));
+    r->start = r->pos;
+    r->id = id ? id : ++lastid;
+    r->name = dup;
+    return r;
+}
+
+/**
+ * Start new recording, recordback seconds back if that's set.
+ * \return The recording, or 0 on error.
+ */
+struct reader_t *start_recording(void)
+{
+    long long from = -1;
+
+    if (recordback)
+        from = time_pos(stream_time(ring.head) - recordback * 1000LL, 0);
+    return start_recording_from(from, 0, 0);
+}
+
+/**
+ * Start saving the cached stream part from from to to into a new file, cut
+ * on packet boundaries. It's a recording with an end, fed at its own pace
+ * while the input and the outputs go on.
+ * \return 0 on success, -1 on error.
+ */
+int start_export(long long from, long long to, const char *path)
+{
+    long long b;
+
+    from = data_pos(MAX(from, oldest_pos()));
+    if ((b = stream_boundary(from)) != -1)
+        from = b;
+    to = MIN(to, ring.head);
+    if ((b = packet_start(to)) != -1)
+        to = b;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return -1;
+
+    struct reader_t *r = add_reader(fd, 1);
+    r->pos = from;
+    r->end = MAX(from, to);
+    return 0;
+}
 
 /**
- * Structure for storage.
+ * Scheduled recordings. Each has a wall clock timer of its own, set for its
+ * start and then for its end, padding included. The recording is cut where
+ * the stream was at those times, by the arrival times in the time index, so
+ * a late timer or a start that's already past doesn't move it. Once it's
+ * going, it's a recording like any other, with the same id.
  */
-struct storage_t {
-    struct storage_t *next;
+struct schedule_t {
+    struct watch_t w;
+    struct schedule_t *next;
 
-    char name[32];
-    int fdr, fdw;
-    int offr, offw;
+    int id, started;
+    long long start, end;
+    char *name;
 };
 
-struct storage_t *storage = 0, *last_storage = 0;
+struct schedule_t *schedules = 0;
 
 /**
- * Recording filehandle.
+ * Dropped schedules, freed once the events at hand are dispatched: their
+ * alarm may be among them still.
  */
-FILE *record = 0;
+struct schedule_t *unscheduled = 0;
 
 /**
- * Alloc a new storage and push it to the list.
+ * Drop a scheduled recording, started or not.
  */
-void alloc_storage(void)
+void unschedule(struct schedule_t *s)
 {
-    struct storage_t *s = malloc(sizeof(struct storage_t));
-    if (!s)
+    struct schedule_t **sp = &schedules;
+    while (*sp != s)
+        sp = &(*sp)->next;
+    *sp = s->next;
+
+    del_watch(&s->w);
+    close(s->w.fd);
+    s->w.fd = -1;
+    s->next = unscheduled;
+    unscheduled = s;
+}
+
+/**
+ * Free the dropped schedules.
+ */
+void reap_schedules(void)
+{
+    while (unscheduled) {
+        struct schedule_t *s = unscheduled;
+        unscheduled = s->next;
+        free(s->name);
+        free(s);
+    }
+}
+
+/**
+ * A scheduled recording's time came, start or stop it.
+ */
+void schedule_alarm(struct watch_t *w, uint32_t revents)
+{
+    struct schedule_t *s = w->data;
+    uint64_t n;
+    /* Dropped while its alarm was pending. */
+    if (w->fd == -1)
+        return;
+    if (read(w->fd, &n, sizeof(n)) == -1) {
+        if (errno != EAGAIN)
+            perror("read"), abort();
+        return;
+    }
+
+    if (!s->started) {
+        if (!start_recording_from(time_pos(s->start, 1), s->name, s->id)) {
+            perror("Scheduled recording");
+            unschedule(s);
+            return;
+        }
+        s->started = 1;
+        set_alarm(w, s->end);
+        return;
+    }
+
+    /* Unless it's been stopped already. */
+    for (struct reader_t *r = readers; r; r = r->next)
+        if (r->id == s->id && is_recording(r)) {
+            long long pos = time_pos(s->end, 1);
+            stop_recording(r, (pos != -1) ? pos : ring.head);
+        }
+    unschedule(s);
+}
+
+/**
+ * Schedule a recording from start to end, in ms since the epoch, into file
+ * name, or a new one in the recording dir if it's 0.
+ * \return The schedule.
+ */
+struct schedule_t *schedule_recording(long long start, long long end,
+        const char *name)
+{
+    struct schedule_t *s = malloc(sizeof(struct schedule_t));
+    if (!s || (name && !(s->name = strdup(name))))
         perror("malloc"), abort();
+    if (!name)
+        s->name = 0;
 
+    s->id = ++lastid;
+    s->started = 0;
+    s->start = start;
+    s->end = MAX(start, end);
     s->next = 0;
-    strcpy(s->name, "timeshiftXXXXXX");
-    s->fdw = mkstemp(s->name);
-    if (s->fdw == -1)
-        perror("mkstemp"), abort();
-    s->fdr = open(s->name, O_RDONLY);
-    if (s->fdr == -1)
-        perror("open"), abort();
-    s->offr = s->offw = 0;
 
-    struct storage_t **sp = &storage;
+    struct schedule_t **sp = &schedules;
     while (*sp)
         sp = &(*sp)->next;
     *sp = s;
-    last_storage = s;
+
+    add_alarm(&s->w, start, schedule_alarm);
+    s->w.data = s;
+    return s;
 }
 
 /**
- * Drop the first storage from the list.
+ * Control socket (-C). Clients send a command per line and get a line back:
+ * "ok" and the status as key=value pairs, or "error" and a message. The
+ * commands act on the main output, and reply "error no output" once it's
+ * gone, as does status; the others reply only "ok" then:
+ *  seek N - go to stream position N
+ *  seek +N, seek -N - move N bytes, or N seconds of stream time with an
+ *    "s" after it
+ *  seek @T - go to what arrived at wall clock time T, in seconds since the
+ *    epoch
+ *  live - go to the newest data
+ *  pause - stop at the end of the packet the output is in
+ *  resume
+ *  record start [P [F]] - start a recording, from position P, given like
+ *    for seek, relative to the live edge, to file F, in the recording dir if
+ *    it's relative; replies with its id and file instead of the status
+ *  record stop [N] - stop recording N, or cancel it if it's scheduled, or
+ *    stop all the recordings going on
+ *  record list - the ids and current files of the recordings going on
+ *  schedule A B [PRE POST] [F] - record from wall clock time A to B, in
+ *    seconds since the epoch or from now with a "+" before, starting PRE
+ *    seconds earlier and stopping POST seconds later, to file F; replies
+ *    with its id and times like schedule list
+ *  schedule list - the ids, times and files of the scheduled recordings
+ *  export A B F - save the cached stream from position A to B, given like
+ *    for record start, to file F; it's done in the background, status
+ *    counts the ones going on
+ *  status
+ * Seeks land on packet boundaries, once the output finishes the packet it
+ * is in.
  */
-void drop_storage(void)
+#define CONTROL_LINE 256
+
+struct client_t {
+    struct watch_t w;
+    char buf[CONTROL_LINE];
+    int len;
+};
+
+char *controlpath = 0;
+struct watch_t controlw;
+time_t started;
+
+/**
+ * Average input rate in bytes per second.
+ */
+long long input_rate(void)
 {
-    if (!storage)
-        fprintf(stderr, "No storage to drop!\n"), abort();
+    time_t t = monotime() - started;
+    return ring.head / (t > 0 ? t : 1);
+}
 
-    struct storage_t *s = storage;
+/**
+ * Move an output to the packet at stream position pos, or the first one
+ * after it. Near the end, that's the last one, even if it's partial.
+ */
+void seek_reader(struct reader_t *r, long long pos)
+{
+    pos = data_pos(MAX(oldest_pos(), MIN(pos, ring.head)));
 
-    close(s->fdw);
-    close(s->fdr);
-    unlink(s->name);
+    long long b = stream_boundary(pos);
+    if (b == -1)
+        b = packet_start(pos);
+    if (b != -1)
+        pos = b;
 
-    storage = storage->next;
-    free(s);
-    if (s == last_storage)
-        last_storage = 0;
+    /* Let it finish the packet it's in first, staying if that's the one. */
+    reader_storage(r);
+    long long until = stream_boundary(r->pos);
+    if (until == -1 && (until = packet_start(r->pos)) != -1 &&
+            until != r->pos)
+        until += TS_PACKET;
+    if (pos == until - TS_PACKET)
+        pos = until;
+
+    if (until == -1 || until == r->pos) {
+        r->pos = pos;
+        r->seek = -1;
+    } else {
+        r->seek = pos;
+        r->until = until;
+    }
 }
 
 /**
- * Clean up the storage.
+ * Reply to a control client. Replies are short, a client that doesn't
+ * take them doesn't get them.
  */
-void drop_all_storage(void)
+void control_reply(struct client_t *c, const char *reply)
 {
-    while (storage)
-        drop_storage();
+    if (write(c->w.fd, reply, strlen(reply)) == -1 && errno != EAGAIN &&
+            errno != EPIPE && errno != ECONNRESET)
+        perror("write"), abort();
 }
 
 /**
- * Drop all filled and read storage.
+ * Reply with the status of the main output and the cache, only "ok" if the
+ * output is gone.
  */
-void drop_used_storage(void)
+void control_status(struct client_t *c)
 {
-    while (storage && storage->offr == storage->offw &&
-            storage->offw == chunksize) {
-        drop_storage();
+    struct reader_t *r = main_output;
+    if (!r) {
+        control_reply(c, "ok\n");
+        return;
     }
+
+    long long pos = (r->seek != -1) ? r->seek : r->pos;
+    int n = 0, nrec = 0;
+    for (struct reader_t *o = readers; o; o = o->next) {
+        if (o->record && !o->id)
+            n++;
+        if (is_recording(o))
+            nrec++;
+    }
+
+    char reply[2 * CONTROL_LINE];
+    snprintf(reply, sizeof(reply), "ok pos=%lld start=%lld end=%lld"
+            " behind=%lld delay=%lld rate=%lld paused=%d recording=%d"
+            " exports=%d outputs=%d input=%d evicted=%lld dropped=%lld"
+            " spilled=%lld blocked=%lld\n",
+            pos, oldest_pos(), ring.head, ring.head - pos,
+            stream_time(ring.head) - stream_time(pos), input_rate(),
+            r->paused, nrec, n, noutputs, in, evicted, dropped,
+            spilled, blocked);
+    control_reply(c, reply);
 }
 
 /**
- * Write the data to one storage, alloc it if needed.
- * \return The amount of data that actually fit into this storage.
+ * Reply with a recording's id and current file, or all of them going on if
+ * it's 0.
  */
-int do_storage_write(const char *buf, int bufsz)
+void control_recordings(struct client_t *c, struct reader_t *only)
 {
-    if (!last_storage || last_storage->offw == chunksize)
-        alloc_storage();
-
-    struct storage_t *s = last_storage;
-    const char *p = buf;
-    int sz;
+    char reply[MAX_RECORDINGS * CONTROL_LINE] = "ok";
+    int len = 2;
 
-    while (s->offw < chunksize && (p - buf) < bufsz) {
-        int towr = MIN(chunksize - s->offw, bufsz - (p - buf));
-        sz = write(s->fdw, p, towr);
-        if (sz == -1) {
-	    /* Silently fail if the disk is full. */
-	    if (errno == ENOSPC)
-		return bufsz;
-	    else
-		perror("write"), abort();
-	}
-        p += sz;
-        s->offw += sz;
+    for (struct reader_t *r = readers; r; r = r->next) {
+        if (only ? r != only : !is_recording(r))
+            continue;
+        int n = snprintf(reply + len, sizeof(reply) - len,
+                r->part ? " id=%d file=%s.%d" : " id=%d file=%s",
+                r->id, r->name, r->part);
+        if (n >= sizeof(reply) - len - 1)
+            break;
+        len += n;
     }
 
-    return p - buf;
+    strcpy(reply + len, "\n");
+    control_reply(c, reply);
 }
 
 /**
- * Write all the data to the storage.
+ * Reply with a scheduled recording's id, times and file, or all of them if
+ * it's 0.
  */
-void write_storage(const char *buf, int bufsz)
+void control_schedules(struct client_t *c, struct schedule_t *only)
 {
-    const char *p = buf;
+    char reply[MAX_RECORDINGS * CONTROL_LINE] = "ok";
+    int len = 2;
 
-    while ((p - buf) < bufsz) {
-        int sz = do_storage_write(p, bufsz - (p - buf));
-        p += sz;
+    for (struct schedule_t *s = schedules; s; s = s->next) {
+        if (only && s != only)
+            continue;
+        int n = snprintf(reply + len, sizeof(reply) - len,
+                " id=%d start=%lld end=%lld started=%d file=%s", s->id,
+                s->start / 1000, s->end / 1000, s->started,
+                s->name ? s->name : "-");
+        if (n >= sizeof(reply) - len - 1)
+            break;
+        len += n;
     }
+
+    strcpy(reply + len, "\n");
+    control_reply(c, reply);
 }
 
 /**
- * Return if there is data available.
+ * Parse a wall clock time given to a control command: seconds since the
+ * epoch, or from now with a "+" before.
+ * \return 0 on success, or the error to reply.
  */
-int data_available(void)
+const char *control_time(const char *arg, long long *ms)
 {
-    drop_used_storage();
+    char *end;
+    long long n = strtoll(arg, &end, 10);
+
+    if (end == arg || *end || *arg == '-')
+        return "error bad time\n";
+
+    *ms = n * 1000 + ((*arg == '+') ? walltime() : 0);
+    return 0;
+}
+
+/**
+ * The full name of a file given to a control command, in the recording dir
+ * if it's relative.
+ */
+char *control_file(const char *file)
+{
+    char *path = malloc(strlen(recorddir) + strlen(file) + 2);
+    if (!path)
+        perror("malloc"), abort();
 
-    if (storage)
-        return storage->offw - storage->offr;
+    if (file[0] == '/')
+        strcpy(path, file);
     else
-        return 0;
+        sprintf(path, "%s/%s", recorddir, file);
+    return path;
 }
 
 /**
- * Read data from storage. Does not advance the read offset.
- * \return The amount of data read.
+ * Parse a position given to a control command: a stream position, bytes or
+ * seconds relative to pos, or a wall clock time.
+ * \return 0 on success, or the error to reply.
  */
-int read_storage(char *buf, int bufsz)
+const char *control_position(const char *arg, long long pos, long long *res)
 {
-    if (!storage)
-        fprintf(stderr, "No storage to read from!\n"), abort();
+    char *end;
+    int wall = (*arg == '@');
+    long long n = strtoll(arg + wall, &end, 10);
+    int rel = (*arg == '+' || *arg == '-');
+    int secs = (*end == 's' && rel);
 
-    struct storage_t *s = storage;
+    if (end == arg + wall || *(end + secs) || (wall && rel))
+        return "error bad position\n";
 
-    int tord = MIN(s->offw - s->offr, bufsz);
-    int sz = read(s->fdr, buf, tord);
-    if (sz == -1)
-        perror("read"), abort();
-    if (sz == 0)
-        fprintf(stderr, "End of file in read_storage, shouldn't happen.\n"),
-	    abort();
+    if (secs || wall) {
+        *res = wall ? time_pos(n * 1000, 1) :
+            time_pos(stream_time(pos) + n * 1000, 0);
+        if (*res == -1)
+            return "error no time index yet\n";
+    } else {
+        *res = rel ? pos + n : n;
+    }
+
+    return 0;
+}
+
+/**
+ * Do one control command.
+ */
+void control_command(struct client_t *c, char *line)
+{
+    static char msg[CONTROL_LINE];
+    struct reader_t *r = main_output;
+    const char *err = 0;
+    long long pos;
 
-    if (lseek(s->fdr, -sz, SEEK_CUR) == -1)
-        perror("lseek"), abort();
+    if (!r && (!strncmp(line, "seek ", 5) || !strcmp(line, "live") ||
+                !strcmp(line, "pause") || !strcmp(line, "resume") ||
+                !strcmp(line, "status"))) {
+        err = "error no output\n";
+    } else if (!strncmp(line, "seek ", 5)) {
+        if (!(err = control_position(line + 5,
+                        (r->seek != -1) ? r->seek : r->pos, &pos)))
+            seek_reader(r, pos);
+    } else if (!strncmp(line, "record start", 12)) {
+        char a[32], file[CONTROL_LINE];
+        int n = sscanf(line + 12, " %31s %255s", a, file);
+        struct reader_t *rec = 0;
 
-    return sz;
+        if (n == EOF || n == 0) {
+            rec = start_recording();
+        } else if (line[12] != ' ') {
+            err = "error unknown command\n";
+        } else if (!(err = control_position(a, ring.head, &pos))) {
+            char *path = (n == 2) ? control_file(file) : 0;
+            rec = start_recording_from(pos, path, 0);
+            free(path);
+        }
+
+        if (rec) {
+            control_recordings(c, rec);
+            return;
+        }
+        if (!err) {
+            snprintf(msg, sizeof(msg), "error %s\n", strerror(errno));
+            err = msg;
+        }
+    } else if (!strncmp(line, "record stop", 11)) {
+        char *end;
+        int id = strtol(line + 11, &end, 10);
+
+        if (*end || (line[11] && (line[11] != ' ' || id <= 0))) {
+            err = "error bad recording\n";
+        } else if (!id) {
+            stop_recordings();
+        } else {
+            err = "error no such recording\n";
+            for (struct reader_t *o = readers; o; o = o->next)
+                if (o->id == id && is_recording(o)) {
+                    stop_recording(o, ring.head);
+                    err = 0;
+                }
+            for (struct schedule_t *s = schedules; s; s = s->next)
+                if (s->id == id && !s->started) {
+                    unschedule(s);
+                    err = 0;
+                    break;
+                }
+        }
+    } else if (!strcmp(line, "record list")) {
+        control_recordings(c, 0);
+        return;
+    } else if (!strcmp(line, "schedule list")) {
+        control_schedules(c, 0);
+        return;
+    } else if (!strncmp(line, "schedule ", 9)) {
+        char a[32], b[32], pre[32], post[32], file[CONTROL_LINE];
+        long long start, end, before = 0, after = 0;
+        int n = sscanf(line + 9, "%31s %31s %31s %31s %255s", a, b, pre,
+                post, file);
+        char *f = (n == 3) ? pre : (n == 5) ? file : 0;
+
+        if (n < 2) {
+            err = "error bad schedule\n";
+        } else if (!(err = control_time(a, &start)) &&
+                !(err = control_time(b, &end))) {
+            if (n >= 4) {
+                char *e1, *e2;
+                before = strtoll(pre, &e1, 10);
+                after = strtoll(post, &e2, 10);
+                if (*e1 || *e2 || before < 0 || after < 0)
+                    err = "error bad padding\n";
+            }
+            if (!err) {
+                char *path = f ? control_file(f) : 0;
+                struct schedule_t *s = schedule_recording(
+                        start - before * 1000, end + after * 1000, path);
+                free(path);
+                control_schedules(c, s);
+                return;
+            }
+        }
+    } else if (!strncmp(line, "export ", 7)) {
+        char a[32], b[32], file[CONTROL_LINE];
+        long long from, to;
+
+        if (sscanf(line + 7, "%31s %31s %255s", a, b, file) != 3) {
+            err = "error bad export\n";
+        } else if (!(err = control_position(a, ring.head, &from)) &&
+                !(err = control_position(b, ring.head, &to))) {
+            char *path = control_file(file);
+            if (start_export(from, to, path) == -1) {
+                snprintf(msg, sizeof(msg), "error %s\n", strerror(errno));
+                err = msg;
+            }
+            free(path);
+        }
+    } else if (!strcmp(line, "live")) {
+        seek_reader(r, ring.head);
+    } else if (!strcmp(line, "pause")) {
+        /* At the end of the packet it's in, so that the retention can
+         * drop what's before it. */
+        if (r->seek == -1)
+            seek_reader(r, r->pos);
+        r->paused = 1;
+    } else if (!strcmp(line, "resume")) {
+        r->paused = 0;
+    } else if (strcmp(line, "status")) {
+        err = "error unknown command\n";
+    }
+
+    if (err)
+        control_reply(c, err);
+    else
+        control_status(c);
 }
 
 /**
- * Advance read offset.
+ * A control client sent something, do the commands in it.
  */
-void advance_storage(int sz)
+void control_read(struct watch_t *w, uint32_t revents)
 {
-    if (!storage)
-        fprintf(stderr, "No storage to advance!\n"), abort();
+    struct client_t *c = w->data;
 
-    storage->offr += sz;
+    int sz = read(w->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len);
+    if (sz == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (sz <= 0) {
+        del_watch(w);
+        close(w->fd);
+        free(c);
+        return;
+    }
+    c->len += sz;
+
+    char *line = c->buf, *nl;
+    while ((nl = memchr(line, '\n', c->buf + c->len - line))) {
+        *nl = 0;
+        if (nl > line && nl[-1] == '\r')
+            nl[-1] = 0;
+        control_command(c, line);
+        line = nl + 1;
+    }
 
-    if (lseek(storage->fdr, sz, SEEK_CUR) == -1)
-        perror("lseek"), abort();
+    c->len -= line - c->buf;
+    memmove(c->buf, line, c->len);
+    if (c->len == sizeof(c->buf) - 1) {
+        control_reply(c, "error line too long\n");
+        c->len = 0;
+    }
 }
 
 /**
- * Stop recording, if any.
+ * A new control client.
  */
-void stop_recording(void)
+void control_accept(struct watch_t *w, uint32_t revents)
 {
-    if (record) {
-        fclose(record);
-        record = 0;
+    int fd = accept4(w->fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+            perror("accept4");
+        return;
     }
+
+    struct client_t *c = malloc(sizeof(struct client_t));
+    if (!c)
+        perror("malloc"), abort();
+    c->len = 0;
+
+    add_watch(&c->w, fd, control_read);
+    c->w.data = c;
+    set_watch(&c->w, EPOLLIN);
 }
 
 /**
- * Start new recording.
+ * Signals came: INT and TERM quit, USR1 starts a new recording and USR2
+ * stops it. They are read in the event loop, so they are acted on between
+ * the other events, like control commands.
  */
-void start_recording(void)
+void signal_event(struct watch_t *w, uint32_t revents)
 {
-    stop_recording();
+    struct signalfd_siginfo si;
+    ssize_t sz;
 
-    char name[strlen(recorddir) + 20];
-    strcpy(name, recorddir);
-    strcat(name, "/recordXXXXXX");
+    while ((sz = read(w->fd, &si, sizeof(si))) == sizeof(si)) {
+        if (si.ssi_signo == SIGINT || si.ssi_signo == SIGTERM) {
+            quit = 1;
+            continue;
+        }
 
-    int fd = mkstemp(name);
-    if (fd == -1)
-        perror("mkstemp"), abort();
+        if (recording)
+            stop_recording(recording, ring.head);
+        if (si.ssi_signo == SIGUSR1 && !(recording = start_recording()))
+            perror("Recording");
+    }
 
-    record = fdopen(fd, "ab");
-    if (!record)
-        perror("fdopen"), abort();
+    if (sz == -1 && errno != EAGAIN && errno != EINTR)
+        perror("read"), abort();
 }
 
 /**
- * Signal handler. Free storage and quit.
+ * A new consumer connected to the -l socket.
  */
-void sig(int num) {
-    drop_all_storage();
-    exit(0);
+void consumer_accept(struct watch_t *w, uint32_t revents)
+{
+    int fd = accept4(w->fd, 0, 0, SOCK_CLOEXEC);
+    if (fd == -1) {
+        if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+            perror("accept4");
+        return;
+    }
+
+    take_consumer(fd);
+}
+
+/**
+ * See whether a new consumer opened the -l FIFO for reading.
+ */
+void consumer_retry(struct watch_t *w, uint32_t revents)
+{
+    uint64_t n;
+    if (read(w->fd, &n, sizeof(n)) == -1 && errno != EAGAIN)
+        perror("read"), abort();
+
+    int fd = open(consumerpath, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd != -1) {
+        take_consumer(fd);
+    } else if (errno != ENXIO) {
+        perror("open");
+        set_timer(w, 0);
+    }
 }
 
 /**
- * USR1 signal handler - start recording.
+ * Make path absolute, so that it's still right after the chdir to the
+ * cache dir.
  */
-void sigusr1(int num) {
-    start_recording();
+char *absolute_path(char *path)
+{
+    if (path[0] == '/')
+        return path;
+
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+        perror("getcwd"), abort();
+    char *abs = malloc(strlen(cwd) + strlen(path) + 2);
+    if (!abs)
+        perror("malloc"), abort();
+    sprintf(abs, "%s/%s", cwd, path);
+    return abs;
 }
 
 /**
- * USR2 signal handler - stop recording.
+ * Create a listening UNIX socket at path, the control socket or the -l one.
+ * \return The listening socket.
  */
-void sigusr2(int num) {
-    stop_recording();
+int listen_socket(const char *path)
+{
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(-1);
+    }
+    strcpy(sa.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        perror("socket"), abort();
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1)
+        perror("bind"), abort();
+    if (listen(fd, 4) == -1)
+        perror("listen"), abort();
+
+    return fd;
 }
 
 int main(int argc, char *argv[])
 {
     signal(SIGPIPE, SIG_IGN);
-    signal(SIGINT, sig);
-    signal(SIGTERM, sig);
-    signal(SIGUSR1, sigusr1);
-    signal(SIGUSR2, sigusr2);
+
+    /* Blocked before any thread starts, so they all come to the signalfd. */
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGUSR1);
+    sigaddset(&sigs, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &sigs, 0) == -1)
+        perror("sigprocmask"), abort();
 
     while (1) {
         char c;
 
-        if ((c = getopt(argc, argv, "hd:r:s:")) == -1)
+        if ((c = getopt(argc, argv, "hd:r:B:R:L:s:umtw:Hc:S:T:o:O:C:l:")) == -1)
             break;
 
         switch (c) {
@@ -292,6 +4270,30 @@ int main(int argc, char *argv[])
                 recorddir = optarg;
                 break;
 
+            case 'B':
+                recordback = atoi(optarg);
+                if (recordback <= 0) {
+                    fprintf(stderr, "Bad recording start\n");
+                    return -1;
+                }
+                break;
+
+            case 'R':
+                rotatesize = atoll(optarg);
+                if (rotatesize <= 0) {
+                    fprintf(stderr, "Bad rotation size\n");
+                    return -1;
+                }
+                break;
+
+            case 'L':
+                rotatetime = atoi(optarg) * 60;
+                if (rotatetime <= 0) {
+                    fprintf(stderr, "Bad rotation time\n");
+                    return -1;
+                }
+                break;
+
             case 's':
                 chunksize = atoi(optarg);
                 if (!chunksize) {
@@ -300,12 +4302,125 @@ int main(int argc, char *argv[])
                 }
                 break;
 
+            case 'u':
+                if (uring_init() == -1)
+                    fprintf(stderr, "io_uring not available, not using it\n");
+                break;
+
+            case 'm':
+                use_mmap = 1;
+                break;
+
+            case 't':
+                use_threads = 1;
+                break;
+
+            case 'w':
+                write_behind = 1;
+                ring.size = atoi(optarg);
+                if (ring.size <= 0) {
+                    fprintf(stderr, "Bad write-behind size\n");
+                    return -1;
+                }
+                break;
+
+            case 'H':
+                use_hugepages = 1;
+                break;
+
+            case 'c':
+                cachefile = optarg;
+                break;
+
+            case 'S':
+                cachesize = atoll(optarg);
+                if (cachesize <= 0) {
+                    fprintf(stderr, "Bad cache size\n");
+                    return -1;
+                }
+                break;
+
+            case 'T':
+                cachetime = atoi(optarg) * 60;
+                if (cachetime <= 0) {
+                    fprintf(stderr, "Bad cache time\n");
+                    return -1;
+                }
+                break;
+
+            case 'o':
+                if (!strcmp(optarg, "drop"))
+                    overflow = OVERFLOW_DROP;
+                else if (!strcmp(optarg, "block"))
+                    overflow = OVERFLOW_BLOCK;
+                else if (!strcmp(optarg, "spill"))
+                    overflow = OVERFLOW_SPILL;
+                else {
+                    fprintf(stderr, "Bad overflow policy\n");
+                    return -1;
+                }
+                break;
+
+            case 'O':
+                if (noutfds == MAX_OUTPUTS) {
+                    fprintf(stderr, "Too many outputs\n");
+                    return -1;
+                }
+                outfds[noutfds] = open(optarg,
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+                if (outfds[noutfds] == -1)
+                    perror("open"), abort();
+                noutfds++;
+                break;
+
+            case 'C':
+                controlpath = optarg;
+                break;
+
+            case 'l':
+                consumerpath = optarg;
+                break;
+
             case 'h':
                 fprintf(stderr, "Usage: %s [options]\n", argv[0]);
                 fprintf(stderr, " -h - this message\n");
                 fprintf(stderr, " -d dir - cache dir\n");
                 fprintf(stderr, " -r dir - recording dir\n");
+                fprintf(stderr, " -B sec - start recordings sec seconds"
+                        " back, from the cache\n");
+                fprintf(stderr, " -R sz - go on in a new file every sz bytes"
+                        " of a recording\n");
+                fprintf(stderr, " -L min - go on in a new file every min"
+                        " minutes of stream time\n");
                 fprintf(stderr, " -s sz - chunk size\n");
+                fprintf(stderr, " -u - use io_uring for the cache\n");
+                fprintf(stderr, " -m - mmap the cache chunks\n");
+                fprintf(stderr, " -t - write the cache and the recordings"
+                        " from threads\n");
+                fprintf(stderr, " -w sz - keep up to sz bytes in memory,"
+                        " write to the cache only beyond that\n");
+                fprintf(stderr, "         without -d, keep only those\n");
+                fprintf(stderr, " -H - put the -w memory on hugepages\n");
+                fprintf(stderr, " -c file - use file or block device as"
+                        " a circular cache instead of -d\n");
+                fprintf(stderr, " -S sz - cache size, keep at most"
+                        " this much with -d\n");
+                fprintf(stderr, " -T min - keep the last min minutes"
+                        " of the cache\n");
+                fprintf(stderr, " -o policy - when the cache is full: drop"
+                        " the oldest data (default),\n");
+                fprintf(stderr, "             block the input or spill"
+                        " to memory (-w sz or chunk size)\n");
+                fprintf(stderr, " -O file - feed file too, at its own pace"
+                        " (can be repeated)\n");
+                fprintf(stderr, " -C path - control socket for seeking,"
+                        " pausing and recording\n");
+                fprintf(stderr, " -l path - when the output goes away, keep"
+                        " caching and go on where it\n");
+                fprintf(stderr, "           left off for the next one: a"
+                        " FIFO opened at path, or a\n");
+                fprintf(stderr, "           connection to the UNIX socket"
+                        " made there\n");
                 return 0;
 
             case ':':
@@ -315,58 +4430,146 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (!cachedir) {
+    if (cachefile && (cachedir || ring.size)) {
+        fprintf(stderr, "Cache file can't be used with -d or -w\n");
+        return -1;
+    }
+
+    if (!cachedir && !cachefile && !ring.size) {
         fprintf(stderr, "Cache dir not specified\n");
         return -1;
     }
 
     if (!recorddir)
-        recorddir = cachedir;
+        recorddir = cachedir ? cachedir : ".";
+
+    int controlfd = -1, consumerfd = -1;
+    if (controlpath)
+        controlfd = listen_socket(controlpath = absolute_path(controlpath));
+    if (consumerpath) {
+        struct stat st;
+        consumerpath = absolute_path(consumerpath);
+        consumerfifo = !stat(consumerpath, &st) && S_ISFIFO(st.st_mode);
+        if (!consumerfifo)
+            consumerfd = listen_socket(consumerpath);
+    }
 
-    if (chdir(cachedir) == -1)
+    if (cachedir && chdir(cachedir) == -1)
         perror("chdir"), abort();
 
-    int in = 1, data = 0;
-
-    while ((data = data_available()) || in) {
-        fd_set rd, wr;
-        FD_ZERO(&rd);
-        if (in) FD_SET(0, &rd);
-        FD_ZERO(&wr);
-        if (data) FD_SET(1, &wr);
-
-        int ret = TEMP_FAILURE_RETRY(select(2, &rd, &wr, 0, 0));
-        if (ret == -1)
-            perror("select"), abort();
-
-        if (FD_ISSET(0, &rd)) {
-            char buffer[4096];
-            int sz = read(0, buffer, 4096);
-            if (sz == -1 || sz == 0)
-                in = 0;
-            else
-                write_storage(buffer, sz);
-        }
+    set_nonblock(infd);
 
-        if (FD_ISSET(1, &wr)) {
-            char buffer[4096];
-            int sz = read_storage(buffer, 4096);
-            int wsz = write(1, buffer, sz);
-            if (wsz == -1)
-                goto exit;
-            advance_storage(wsz);
+    /* The policies that hold data back need somewhere to hold it. */
+    if (cachedir && !ring.size && overflow != OVERFLOW_DROP)
+        ring.size = chunksize;
 
-            /*
-             * Record.
-             */
-            if (record)
-                if (fwrite(buffer, wsz, 1, record) != 1)
-                    fprintf(stderr, "Recording error"), stop_recording();
+    if (ring.size || cachefile)
+        alloc_ring();
+
+    if (use_threads && uring.fd != -1) {
+        fprintf(stderr, "Threads and io_uring can't be used together\n");
+        return -1;
+    }
+
+    /* The write-behind tier and the writer thread need the data in user
+     * space. */
+    splice_in = is_pipe(infd) && !ring.size && !use_threads;
+
+    init_events();
+    int sigfd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd == -1)
+        perror("signalfd"), abort();
+    add_watch(&sigw, sigfd, signal_event);
+    set_watch(&sigw, EPOLLIN);
+    add_watch(&inw, infd, ingest);
+    set_watch(&inw, EPOLLIN);
+    main_output = add_reader(outfd, 0);
+    for (int i = 0; i < noutfds; i++)
+        add_reader(outfds[i], 0);
+    if (controlfd != -1) {
+        add_watch(&controlw, controlfd, control_accept);
+        set_watch(&controlw, EPOLLIN);
+    }
+    if (consumerfifo)
+        add_timer(&consumerw, 0, consumer_retry);
+    if (consumerfd != -1) {
+        add_watch(&consumerw, consumerfd, consumer_accept);
+        set_watch(&consumerw, EPOLLIN);
+    }
+    started = monotime();
+    if (cachedir)
+        add_timer(&poolw, 10, prewarm_pool);
+    add_timer(&retryw, 0, retry_overflow);
+    int retrying = 0;
+
+    if (uring.fd != -1) {
+        add_watch(&uringw, uring.efd, uring_wake);
+        set_watch(&uringw, EPOLLIN);
+    }
+
+    if (use_threads) {
+        int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake == -1)
+            perror("eventfd"), abort();
+        add_watch(&wakew, wake, queue_wake);
+        set_watch(&wakew, EPOLLIN);
+
+        queue_init(&writer, write_job, wake);
+        queue_init(&recorder, record_job, wake);
+    }
+
+    while (!quit && (noutputs || consumerpath) &&
+            (in || any_data_available())) {
+        /* The recordings share the disk, so stop them all. */
+        if (use_threads && __atomic_exchange_n(&recorder.failed, 0,
+                    __ATOMIC_RELAXED))
+            stop_recordings();
+
+        /* Here too, for when no output reads, paused or detached. */
+        drop_used_storage();
+
+        struct reader_t *r, *next;
+        for (r = readers; r; r = next) {
+            next = r->next;
+            if (reader_done(r))
+                del_reader(r);
+            else if (r->fd != -1)
+                set_watch(r->w, reader_ready(r) ? EPOLLOUT : 0);
+        }
+        if (in)
+            set_watch(&inw, storage_room() ? EPOLLIN : 0);
+        run_events();
+        reap_schedules();
+        attach_output();
+        uring_flush();
+
+        if (disk_full != retrying) {
+            retrying = disk_full;
+            set_timer(&retryw, retrying ? RETRY_INTERVAL : 0);
         }
     }
 
-exit:
+    while (schedules)
+        unschedule(schedules);
+    reap_schedules();
+
+    finish_recordings();
     drop_all_storage();
+    if (controlpath)
+        unlink(controlpath);
+    if (consumerfd != -1)
+        unlink(consumerpath);
+
+    if (use_threads) {
+        queue_stop(&writer);
+        queue_stop(&recorder);
+        dropped += writer.lost;
+    }
+
+    if (evicted || dropped || spilled || blocked)
+        fprintf(stderr, "Cache overflow: %lld bytes evicted, %lld dropped,"
+                " %lld spilled, %lld blocked\n", evicted, dropped, spilled,
+                blocked);
 
     return 0;
 }